@@ -0,0 +1,52 @@
+//
+// Created by Edge on 2020/6/14.
+//
+
+#include <algorithm>
+#include "Arena.h"
+
+constexpr size_t Arena::MIN_CHUNK_SIZE;
+
+Arena::~Arena() {
+    release();
+}
+
+void Arena::reserve(size_t size) {
+    if (m_capacity - m_used < size) {
+        addChunk(size);
+    }
+}
+
+void *Arena::allocate(size_t size, size_t alignment) {
+    size_t misalignment = reinterpret_cast<uintptr_t>(m_chunk + m_used) % alignment;
+    size_t padding = misalignment ? alignment - misalignment : 0;
+    if (!m_chunk || m_capacity - m_used < size + padding) {
+        // current chunk is exhausted, worst case padding is taken into account for new chunk
+        addChunk(std::max(size + alignment - 1, MIN_CHUNK_SIZE));
+        misalignment = reinterpret_cast<uintptr_t>(m_chunk) % alignment;
+        padding = misalignment ? alignment - misalignment : 0;
+    }
+    void *result = m_chunk + m_used + padding;
+    m_used += size + padding;
+    return result;
+}
+
+void Arena::release() {
+    for (uint8_t *chunk : m_chunks) {
+        delete[] chunk;
+    }
+    m_chunks.clear();
+    m_chunk = nullptr;
+    m_used = m_capacity = 0;
+}
+
+size_t Arena::getChunkCount() const {
+    return m_chunks.size();
+}
+
+void Arena::addChunk(size_t size) {
+    m_chunk = new uint8_t[size];
+    m_chunks.push_back(m_chunk);
+    m_used = 0;
+    m_capacity = size;
+}
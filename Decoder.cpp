@@ -5,13 +5,49 @@
 #include "Decoder.h"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
 #include "bitmap_image.hpp"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
-constexpr int Image::R_COMPONENT;
-constexpr int Image::G_COMPONENT;
-constexpr int Image::B_COMPONENT;
+constexpr int Image::ROW_ALIGNMENT;
+constexpr int IntegerIDCT::CONST_BITS;
+constexpr int IntegerIDCT::PASS1_BITS;
+constexpr int ColorConverter::RGB_ORDER;
+constexpr int ColorConverter::BGR_ORDER;
+constexpr int ColorConverter::SCALE_BITS;
+constexpr int ColorConverter::CR_TO_R;
+constexpr int ColorConverter::CB_TO_G;
+constexpr int ColorConverter::CR_TO_G;
+constexpr int ColorConverter::CB_TO_B;
+
+int NaiveDezigzag::ZIGZAG_TABLE[8][8] = {
+        {0,  1,  5,  6,  14, 15, 27, 28},
+        {2,  4,  7,  13, 16, 26, 29, 42},
+        {3,  8,  12, 17, 25, 30, 41, 43},
+        {9,  11, 18, 24, 31, 40, 44, 53},
+        {10, 19, 23, 32, 39, 45, 52, 54},
+        {20, 22, 33, 38, 46, 51, 55, 60},
+        {21, 34, 37, 47, 50, 56, 59, 61},
+        {35, 36, 48, 49, 57, 58, 62, 63}
+};
+
+int EnhancedDezigzag::SWAP_TABLE[8][8] = {
+        {0,  1,  5,  6,  14, 15, 27, 28},
+        {15, 14, 28, 13, 16, 26, 29, 42},
+        {27, 42, 27, 42, 25, 30, 41, 43},
+        {29, 26, 27, 29, 31, 40, 44, 53},
+        {53, 42, 43, 53, 39, 45, 52, 54},
+        {40, 41, 42, 52, 46, 51, 55, 60},
+        {55, 52, 51, 60, 60, 56, 59, 61},
+        {56, 59, 61, 60, 60, 61, 62, 63}
+};
 
 void NaiveDequantization::process(JPEG &jpeg) {
     const SOF0 &sof0 = jpeg.m_sof0;
@@ -27,17 +63,64 @@ void NaiveDequantization::process(JPEG &jpeg) {
     }
 }
 
+void NaiveDequantization::processBlock(float *block, const DQT &dqt, int tableIndex) {
+    ComponentTable::multiplyBlockWith(block, dqt, tableIndex);
+}
+
+void NaiveDequantization::getTable(const DQT &dqt, int tableIndex, float *table) {
+    std::fill(table, table + 64, 1.0f);
+    ComponentTable::multiplyBlockWith(table, dqt, tableIndex);
+}
+
+void AANDequantization::process(JPEG &jpeg) {
+    prepare(jpeg.m_dqt);
+    const SOF0 &sof0 = jpeg.m_sof0;
+    int mcuWidth = jpeg.m_mcus.m_mcuWidth;
+    int mcuHeight = jpeg.m_mcus.m_mcuHeight;
+    // multiply each mcu each component with scaled dqt
+    for (int i = 0; i < mcuHeight; ++i) {
+        for (int j = 0; j < mcuWidth; ++j) {
+            for (int k = 0; k < sof0.m_componentSize; ++k) {
+                ComponentTable &table = *jpeg.m_mcus.m_mcu[i][j].m_component[k];
+                for (int l = 0; l < table.m_verticalSize * table.m_horizontalSize; ++l) {
+                    processBlock(table.m_table + l * 64, jpeg.m_dqt, sof0.m_component[k].m_dqtId);
+                }
+            }
+        }
+    }
+}
+
+void AANDequantization::processBlock(float *block, const DQT &, int tableIndex) {
+    const float *scaledTable = m_scaledTable[tableIndex];
+    for (int i = 0; i < 64; ++i) {
+        block[i] *= scaledTable[i];
+    }
+}
+
+void AANDequantization::prepare(const DQT &dqt) {
+    for (int i = 0; i < 4; ++i) {
+        if (!dqt.m_qs[i]) {
+            continue;
+        }
+        for (int j = 0; j < 8; ++j) {
+            for (int k = 0; k < 8; ++k) {
+                // scale factor depends on natural position (j, k) of the coefficient
+                int index = j * 8 + k;
+                float quantization = (dqt.m_PTq[i] >> 4u) ? ((uint16_t *) dqt.m_qs[i])[index]
+                                                          : ((uint8_t *) dqt.m_qs[i])[index];
+                // AANIDCT leave its result 8 times larger, so divide it here as well
+                m_scaledTable[i][index] =
+                        quantization * AANIDCT::AAN_SCALE_FACTOR[j] * AANIDCT::AAN_SCALE_FACTOR[k] * 0.125f;
+            }
+        }
+    }
+}
+
+void AANDequantization::getTable(const DQT &, int tableIndex, float *table) {
+    std::copy(m_scaledTable[tableIndex], m_scaledTable[tableIndex] + 64, table);
+}
+
 void NaiveDezigzag::process(JPEG &jpeg) {
-    int zigzagTable[8][8] = {
-            {0,  1,  5,  6,  14, 15, 27, 28},
-            {2,  4,  7,  13, 16, 26, 29, 42},
-            {3,  8,  12, 17, 25, 30, 41, 43},
-            {9,  11, 18, 24, 31, 40, 44, 53},
-            {10, 19, 23, 32, 39, 45, 52, 54},
-            {20, 22, 33, 38, 46, 51, 55, 60},
-            {21, 34, 37, 47, 50, 56, 59, 61},
-            {35, 36, 48, 49, 57, 58, 62, 63}
-    };
     const SOF0 &sof0 = jpeg.m_sof0;
     int mcuWidth = jpeg.m_mcus.m_mcuWidth;
     int mcuHeight = jpeg.m_mcus.m_mcuHeight;
@@ -45,28 +128,17 @@ void NaiveDezigzag::process(JPEG &jpeg) {
     for (int i = 0; i < mcuHeight; ++i) {
         for (int j = 0; j < mcuWidth; ++j) {
             for (int k = 0; k < sof0.m_componentSize; ++k) {
-                ComponentTable *componentTable = new ComponentTable();
-                componentTable->init((sof0.m_component[k].m_sampleFactor & 0x0fu),
-                                     (sof0.m_component[k].m_sampleFactor >> 4u));
-                componentTable->replaceWith(*jpeg.m_mcus.m_mcu[i][j].m_component[k], zigzagTable);
-                delete jpeg.m_mcus.m_mcu[i][j].m_component[k];
-                jpeg.m_mcus.m_mcu[i][j].m_component[k] = componentTable;
+                jpeg.m_mcus.m_mcu[i][j].m_component[k]->replaceWith(ZIGZAG_TABLE);
             }
         }
     }
 }
 
+void NaiveDezigzag::processBlock(float *block) {
+    ComponentTable::replaceBlockWith(block, ZIGZAG_TABLE);
+}
+
 void EnhancedDezigzag::process(JPEG &jpeg) {
-    int swapTable[8][8] = {
-            {0,  1,  5,  6,  14, 15, 27, 28},
-            {15, 14, 28, 13, 16, 26, 29, 42},
-            {27, 42, 27, 42, 25, 30, 41, 43},
-            {29, 26, 27, 29, 31, 40, 44, 53},
-            {53, 42, 43, 53, 39, 45, 52, 54},
-            {40, 41, 42, 52, 46, 51, 55, 60},
-            {55, 52, 51, 60, 60, 56, 59, 61},
-            {56, 59, 61, 60, 60, 61, 62, 63}
-    };
     const SOF0 &sof0 = jpeg.m_sof0;
     int mcuWidth = jpeg.m_mcus.m_mcuWidth;
     int mcuHeight = jpeg.m_mcus.m_mcuHeight;
@@ -74,12 +146,27 @@ void EnhancedDezigzag::process(JPEG &jpeg) {
     for (int i = 0; i < mcuHeight; ++i) {
         for (int j = 0; j < mcuWidth; ++j) {
             for (int k = 0; k < sof0.m_componentSize; ++k) {
-                jpeg.m_mcus.m_mcu[i][j].m_component[k]->inPlaceReplaceWith(swapTable);
+                jpeg.m_mcus.m_mcu[i][j].m_component[k]->inPlaceReplaceWith(SWAP_TABLE);
             }
         }
     }
 }
 
+void EnhancedDezigzag::processBlock(float *block) {
+    ComponentTable::inPlaceReplaceBlockWith(block, SWAP_TABLE);
+}
+
+const IIDCT::CosineTable IIDCT::COSINE_TABLE;
+
+IIDCT::CosineTable::CosineTable() : m_value{} {
+    const double pi = acos(-1);
+    for (int i = 0; i < 8; ++i) {
+        for (int x = 0; x < 8; ++x) {
+            m_value[i][x] = cos(0.0625f * (i * 2 + 1) * x * pi);
+        }
+    }
+}
+
 float IIDCT::coefficientPrecompute(int x, int y) {
     // precompute coefficient
     if (x == 0 && y == 0) {
@@ -98,39 +185,37 @@ void NaiveIDCT::process(JPEG &jpeg) {
     for (int i = 0; i < mcuHeight; ++i) {
         for (int j = 0; j < mcuWidth; ++j) {
             for (int k = 0; k < sof0.m_componentSize; ++k) {
-                ComponentTable *componentTable = new ComponentTable();
-                componentTable->init((sof0.m_component[k].m_sampleFactor & 0x0fu),
-                                     (sof0.m_component[k].m_sampleFactor >> 4u));
-                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k], *componentTable);
-                delete jpeg.m_mcus.m_mcu[i][j].m_component[k];
-                jpeg.m_mcus.m_mcu[i][j].m_component[k] = componentTable;
+                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k]);
             }
         }
     }
 }
 
-void NaiveIDCT::performIdctOnComponentTable(ComponentTable &table, ComponentTable &result) {
+void NaiveIDCT::processBlock(float *block) {
+    float result[64];
     for (int i = 0; i < 8; ++i) {
         for (int j = 0; j < 8; ++j) {
-            for (int k = 0; k < table.m_verticalSize; ++k) {
-                for (int l = 0; l < table.m_horizontalSize; ++l) {
-                    result.m_table[i][j][k][l] = computeCoefficientAtIndex(table, k, l, i, j);
-                }
-            }
+            result[i * 8 + j] = computeCoefficientAtIndex(block, i, j);
+        }
+    }
+    std::copy(result, result + 64, block);
+}
+
+void NaiveIDCT::performIdctOnComponentTable(ComponentTable &table) {
+    for (int k = 0; k < table.m_verticalSize; ++k) {
+        for (int l = 0; l < table.m_horizontalSize; ++l) {
+            processBlock(table.getBlock(k, l));
         }
     }
 }
 
-float
-NaiveIDCT::computeCoefficientAtIndex(ComponentTable &table, int verticalComponent, int horizonComponent, int i, int j) {
+float NaiveIDCT::computeCoefficientAtIndex(const float *block, int i, int j) {
     // use O(N^4) to inverse DCT
     float result = 0;
-    const double pi = acos(-1);
+    const double (*cosine)[8] = COSINE_TABLE.m_value;
     for (int x = 0; x < 8; ++x) {
         for (int y = 0; y < 8; ++y) {
-            // TODO computeCoefficientAtIndex can be precompute to table lookup
-            result += coefficientPrecompute(x, y) * cos(0.0625f * (i * 2 + 1) * x * pi) *
-                      cos(0.0625f * (j * 2 + 1) * y * pi) * table.m_table[x][y][verticalComponent][horizonComponent];
+            result += coefficientPrecompute(x, y) * cosine[i][x] * cosine[j][y] * block[x * 8 + y];
         }
     }
     return result * 0.25f;
@@ -143,227 +228,1818 @@ void DimensionReductionIDCT::process(JPEG &jpeg) {
     for (int i = 0; i < mcuHeight; ++i) {
         for (int j = 0; j < mcuWidth; ++j) {
             for (int k = 0; k < sof0.m_componentSize; ++k) {
-                ComponentTable *componentTable = new ComponentTable();
-                componentTable->init((sof0.m_component[k].m_sampleFactor & 0x0fu),
-                                     (sof0.m_component[k].m_sampleFactor >> 4u));
-                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k], *componentTable);
-                delete jpeg.m_mcus.m_mcu[i][j].m_component[k];
-                jpeg.m_mcus.m_mcu[i][j].m_component[k] = componentTable;
+                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k]);
             }
         }
     }
 }
 
-void DimensionReductionIDCT::performIdctOnComponentTable(ComponentTable &table, ComponentTable &result) {
-    const double pi = acos(-1);
-    float precompute[8][8];
+void DimensionReductionIDCT::processBlock(float *block) {
+    performIdctOnBlock(block);
+}
+
+void DimensionReductionIDCT::performIdctOnComponentTable(ComponentTable &table) {
     for (int k = 0; k < table.m_verticalSize; ++k) {
         for (int l = 0; l < table.m_horizontalSize; ++l) {
-            // use O(N^3) to inverse DCT
-            // move j and x term into front summation
-            // use precompute term to accelerate IDCT
-            for (int j = 0; j < 8; ++j) {
-                for (int x = 0; x < 8; ++x) {
-                    precompute[j][x] = (1 / sqrt(2)) * cos(0) * table.m_table[x][0][k][l];
-                    for (int y = 1; y < 8; ++y) {
-                        precompute[j][x] += cos(0.0625f * (j * 2 + 1) * y * pi) * table.m_table[x][y][k][l];
-                    }
-                }
+            performIdctOnBlock(table.getBlock(k, l));
+        }
+    }
+}
+
+void DimensionReductionIDCT::performIdctOnBlock(float *block) {
+    const double (*cosine)[8] = COSINE_TABLE.m_value;
+    const double inverseSqrt2 = 1 / sqrt(2);
+    float precompute[8][8];
+    // result can be written in place, because block is only read while computing precompute term
+    // use O(N^3) to inverse DCT
+    // move j and x term into front summation
+    // use precompute term to accelerate IDCT
+    for (int j = 0; j < 8; ++j) {
+        for (int x = 0; x < 8; ++x) {
+            precompute[j][x] = inverseSqrt2 * block[x * 8];
+            for (int y = 1; y < 8; ++y) {
+                precompute[j][x] += cosine[j][y] * block[x * 8 + y];
             }
-            for (int i = 0; i < 8; ++i) {
-                for (int j = 0; j < 8; ++j) {
-                    float resultValue = (1 / sqrt(2)) * cos(0) * precompute[j][0];
-                    for (int x = 1; x < 8; ++x) {
-                        // TODO computeCoefficientAtIndex can be precompute to table lookup
-                        resultValue += cos(0.0625f * (i * 2 + 1) * x * pi) * precompute[j][x];
-                    }
-                    result.m_table[i][j][k][l] = resultValue * 0.25f;
-                }
+        }
+    }
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            float resultValue = inverseSqrt2 * precompute[j][0];
+            for (int x = 1; x < 8; ++x) {
+                resultValue += cosine[i][x] * precompute[j][x];
             }
+            block[i * 8 + j] = resultValue * 0.25f;
         }
     }
 }
 
-void ImageBlock::FromComponentTable(const ComponentTable &table, int maxVerticalComponent, int maxHorizontalComponent) {
-    // move component table into image MCU's block
-    // upsampling
-    m_table = new float *[8 * maxVerticalComponent];
-    for (int i = 0; i < 8 * maxVerticalComponent; ++i) {
-        m_table[i] = new float[8 * maxHorizontalComponent];
-        for (int j = 0; j < 8 * maxHorizontalComponent; ++j) {
-            int newI = i * table.m_verticalSize / maxVerticalComponent;
-            int newJ = j * table.m_horizontalSize / maxHorizontalComponent;
-            m_table[i][j] = table.m_table[newI % 8][newJ % 8][newI / 8][newJ / 8];
+const float AANIDCT::AAN_SCALE_FACTOR[8] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+void AANIDCT::process(JPEG &jpeg) {
+    const SOF0 &sof0 = jpeg.m_sof0;
+    int mcuWidth = jpeg.m_mcus.m_mcuWidth;
+    int mcuHeight = jpeg.m_mcus.m_mcuHeight;
+    for (int i = 0; i < mcuHeight; ++i) {
+        for (int j = 0; j < mcuWidth; ++j) {
+            for (int k = 0; k < sof0.m_componentSize; ++k) {
+                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k]);
+            }
         }
     }
 }
 
-void ImageMCU::fromMCU(const JPEG &jpeg, const MCU &mcu) {
-    for (int i = 0; i < jpeg.m_sof0.m_componentSize; ++i) {
-        m_block[i].FromComponentTable(*mcu.m_component[i], jpeg.m_sof0.m_maxVerticalComponent,
-                                      jpeg.m_sof0.m_maxHorizontalComponent);
-    }
+void AANIDCT::processBlock(float *block) {
+    performIdctOnBlock(block);
 }
 
-void Image::fromMCUS(const JPEG &jpeg, const MCUS &mcus) {
-    m_mcuWidth = mcus.m_mcuWidth;
-    m_mcuHeight = mcus.m_mcuHeight;
-    m_imcu = new ImageMCU *[m_mcuHeight];
-    for (int i = 0; i < m_mcuHeight; ++i) {
-        m_imcu[i] = new ImageMCU[m_mcuWidth];
-        for (int j = 0; j < m_mcuWidth; ++j) {
-            m_imcu[i][j].fromMCU(jpeg, mcus.m_mcu[i][j]);
+void AANIDCT::performIdctOnComponentTable(ComponentTable &table) {
+    for (int k = 0; k < table.m_verticalSize; ++k) {
+        for (int l = 0; l < table.m_horizontalSize; ++l) {
+            performSparseIdctOnBlock(table.getBlock(k, l), table.getLastNonzero(k, l));
         }
     }
 }
 
-void Image::handleImageBuffer(const JPEG &jpeg) {
-    // compute each image mcu block into image buffer
-    if (!m_storedInBuffer) {
-        m_componentSize = jpeg.m_sof0.m_componentSize;
-        m_maxVerticalComponent = jpeg.m_sof0.m_maxVerticalComponent;
-        m_maxHorizontalComponent = jpeg.m_sof0.m_maxHorizontalComponent;
-        for (int i = 0; i < m_componentSize; ++i) {
-            m_imageBuffer[i] = new float *[m_mcuHeight * 8 * m_maxVerticalComponent];
-            for (int j = 0; j < m_mcuHeight * 8 * m_maxVerticalComponent; ++j) {
-                m_imageBuffer[i][j] = new float[m_mcuWidth * 8 * m_maxHorizontalComponent];
-            }
-        }
-        for (int i = 0; i < m_mcuHeight * 8 * m_maxVerticalComponent; ++i) {
-            for (int j = 0; j < m_mcuWidth * 8 * m_maxHorizontalComponent; ++j) {
-                const ImageMCU &imcu = m_imcu[i / (8 * m_maxVerticalComponent)][j / (8 * m_maxHorizontalComponent)];
-                int tableI = i % (8 * m_maxVerticalComponent);
-                int tableJ = j % (8 * m_maxHorizontalComponent);
-                float y = imcu.m_block[0].m_table[tableI][tableJ];
-                float cb = imcu.m_block[1].m_table[tableI][tableJ];
-                float cr = imcu.m_block[2].m_table[tableI][tableJ];
-                m_imageBuffer[Image::R_COMPONENT][i][j] = yCbCrConverter(Image::R_COMPONENT, y, cb, cr);
-                m_imageBuffer[Image::G_COMPONENT][i][j] = yCbCrConverter(Image::G_COMPONENT, y, cb, cr);
-                m_imageBuffer[Image::B_COMPONENT][i][j] = yCbCrConverter(Image::B_COMPONENT, y, cb, cr);
+// 1-D AAN IDCT, v[i] is i-th input and receive i-th output
+static inline void aanIdct(float *v) {
+    // even part
+    float tmp0 = v[0];
+    float tmp1 = v[2];
+    float tmp2 = v[4];
+    float tmp3 = v[6];
+
+    float tmp10 = tmp0 + tmp2;
+    float tmp11 = tmp0 - tmp2;
+    float tmp13 = tmp1 + tmp3;
+    float tmp12 = (tmp1 - tmp3) * 1.414213562f - tmp13;
+
+    tmp0 = tmp10 + tmp13;
+    tmp3 = tmp10 - tmp13;
+    tmp1 = tmp11 + tmp12;
+    tmp2 = tmp11 - tmp12;
+
+    // odd part
+    float tmp4 = v[1];
+    float tmp5 = v[3];
+    float tmp6 = v[5];
+    float tmp7 = v[7];
+
+    float z13 = tmp6 + tmp5;
+    float z10 = tmp6 - tmp5;
+    float z11 = tmp4 + tmp7;
+    float z12 = tmp4 - tmp7;
+
+    tmp7 = z11 + z13;
+    tmp11 = (z11 - z13) * 1.414213562f;
+    float z5 = (z10 + z12) * 1.847759065f;
+    tmp10 = 1.082392200f * z12 - z5;
+    tmp12 = -2.613125930f * z10 + z5;
+
+    tmp6 = tmp12 - tmp7;
+    tmp5 = tmp11 - tmp6;
+    tmp4 = tmp10 + tmp5;
+
+    v[0] = tmp0 + tmp7;
+    v[7] = tmp0 - tmp7;
+    v[1] = tmp1 + tmp6;
+    v[6] = tmp1 - tmp6;
+    v[2] = tmp2 + tmp5;
+    v[5] = tmp2 - tmp5;
+    v[4] = tmp3 + tmp4;
+    v[3] = tmp3 - tmp4;
+}
+
+// same as aanIdct, but v[4] ~ v[7] are known to be zero
+static inline void aanIdctReduced(float *v) {
+    // even part
+    float tmp12 = v[2] * 1.414213562f - v[2];
+
+    float tmp0 = v[0] + v[2];
+    float tmp3 = v[0] - v[2];
+    float tmp1 = v[0] + tmp12;
+    float tmp2 = v[0] - tmp12;
+
+    // odd part
+    float tmp7 = v[1] + v[3];
+    float tmp11 = (v[1] - v[3]) * 1.414213562f;
+    float z5 = (v[1] - v[3]) * 1.847759065f;
+    float tmp10 = 1.082392200f * v[1] - z5;
+    tmp12 = 2.613125930f * v[3] + z5;
+
+    float tmp6 = tmp12 - tmp7;
+    float tmp5 = tmp11 - tmp6;
+    float tmp4 = tmp10 + tmp5;
+
+    v[0] = tmp0 + tmp7;
+    v[7] = tmp0 - tmp7;
+    v[1] = tmp1 + tmp6;
+    v[6] = tmp1 - tmp6;
+    v[2] = tmp2 + tmp5;
+    v[5] = tmp2 - tmp5;
+    v[4] = tmp3 + tmp4;
+    v[3] = tmp3 - tmp4;
+}
+
+void AANIDCT::processSparseBlock(float *block, int lastNonzero) {
+    performSparseIdctOnBlock(block, lastNonzero);
+}
+
+void AANIDCT::performIdctOnBlock(float *block) {
+    float workspace[64];
+    // 1-D IDCT on each column, then on each row
+    for (int pass = 0; pass < 2; ++pass) {
+        const float *input = pass ? workspace : block;
+        float *output = pass ? block : workspace;
+        // column pass walk down columns, row pass walk along rows
+        int step = pass ? 1 : 8;
+        int stride = pass ? 8 : 1;
+        for (int i = 0; i < 8; ++i) {
+            float v[8];
+            for (int j = 0; j < 8; ++j) {
+                v[j] = input[i * stride + j * step];
+            }
+            aanIdct(v);
+            for (int j = 0; j < 8; ++j) {
+                output[i * stride + j * step] = v[j];
             }
         }
-        m_storedInBuffer = true;
     }
 }
 
-void Image::toPpm(std::ofstream &ofs, const JPEG &jpeg) {
-    ofs << "P6\n";
-    ofs << jpeg.m_sof0.m_width << " " << jpeg.m_sof0.m_height << "\n";
-    ofs << 255 << "\n";
-    handleImageBuffer(jpeg);
-    for (int i = 0; i < jpeg.m_sof0.m_height; ++i) {
-        for (int j = 0; j < jpeg.m_sof0.m_width; ++j) {
-            for (auto &k : m_imageBuffer) {
-                ofs << (clamp(k[i][j]));
-            }
+void AANIDCT::performSparseIdctOnBlock(float *block, int lastNonzero) {
+    if (lastNonzero == 0) {
+        // with scaled dequantization, dc only block is flat and equal to its dc term
+        std::fill(block + 1, block + 64, block[0]);
+    } else if (lastNonzero <= SPARSE_2X2_LAST_NONZERO) {
+        performReducedIdctOnBlock(block, 2);
+    } else if (lastNonzero <= SPARSE_4X4_LAST_NONZERO) {
+        performReducedIdctOnBlock(block, 4);
+    } else {
+        performIdctOnBlock(block);
+    }
+}
+
+void AANIDCT::performReducedIdctOnBlock(float *block, int size) {
+    // columns without input stay zero
+    float workspace[64] = {};
+    // only first size columns have nonzero input, and after column pass only first size coefficients of each row are
+    // nonzero
+    for (int i = 0; i < size; ++i) {
+        float v[8];
+        for (int j = 0; j < 4; ++j) {
+            v[j] = j < size ? block[j * 8 + i] : 0.0f;
+        }
+        aanIdctReduced(v);
+        for (int j = 0; j < 8; ++j) {
+            workspace[j * 8 + i] = v[j];
+        }
+    }
+    for (int i = 0; i < 8; ++i) {
+        float v[8];
+        for (int j = 0; j < 4; ++j) {
+            v[j] = workspace[i * 8 + j];
+        }
+        aanIdctReduced(v);
+        for (int j = 0; j < 8; ++j) {
+            block[i * 8 + j] = v[j];
         }
     }
 }
 
-void Image::saveToBmp(const std::string &filename, const JPEG &jpeg) {
-    // use external library to save image buffer's pixel into bmp image
-    handleImageBuffer(jpeg);
-    bitmap_image image(jpeg.m_sof0.m_width, jpeg.m_sof0.m_height);
-    for (int i = 0; i < jpeg.m_sof0.m_height; ++i) {
-        for (int j = 0; j < jpeg.m_sof0.m_width; ++j) {
-            image.set_pixel(j, i, clamp(m_imageBuffer[0][i][j]), clamp(m_imageBuffer[1][i][j]), clamp(m_imageBuffer[2][i][j]));
+SIMDIDCT::SIMDIDCT() : m_kernel(performIdctOnBlockSse2), m_reducedKernel(performReducedIdctOnBlockSse2) {
+#if defined(__x86_64__)
+    // SSE2 is always available on x86-64
+    if (__builtin_cpu_supports("avx2")) {
+        m_kernel = performIdctOnBlockAvx2;
+        m_reducedKernel = performReducedIdctOnBlockAvx2;
+    }
+#endif
+}
+
+void SIMDIDCT::process(JPEG &jpeg) {
+    const SOF0 &sof0 = jpeg.m_sof0;
+    int mcuWidth = jpeg.m_mcus.m_mcuWidth;
+    int mcuHeight = jpeg.m_mcus.m_mcuHeight;
+    for (int i = 0; i < mcuHeight; ++i) {
+        for (int j = 0; j < mcuWidth; ++j) {
+            for (int k = 0; k < sof0.m_componentSize; ++k) {
+                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k]);
+            }
         }
     }
-    image.save_image(filename);
 }
 
-float Image::yCbCrConverter(int component, float y, float cb, float cr) {
-    if (component == Image::R_COMPONENT) {
-        return y + 1.402f * cr + 128.0f;
-    } else if (component == Image::G_COMPONENT) {
-        return y - 0.71414f * cr - 0.34414f * cb + 128.0f;
+void SIMDIDCT::processBlock(float *block) {
+    m_kernel(block);
+}
+
+void SIMDIDCT::processSparseBlock(float *block, int lastNonzero) {
+    // vector lanes already cover 4 coefficients, so 2x2 block use the same reduced kernel as 4x4 block
+    if (lastNonzero == 0) {
+        std::fill(block + 1, block + 64, block[0]);
+    } else if (lastNonzero <= SPARSE_4X4_LAST_NONZERO) {
+        m_reducedKernel(block);
     } else {
-        return y + 1.772f * cb + 128.0f;
+        m_kernel(block);
     }
 }
 
-uint8_t Image::clamp(float value) {
-    if (value > 255) {
-        return 255;
-    } else if (value < 0) {
-        return 0;
-    } else {
-        // round value
-        return (value - ((int)value) >= 0.5 ? value + 1 : value);
+void SIMDIDCT::performIdctOnComponentTable(ComponentTable &table) {
+    for (int k = 0; k < table.m_verticalSize; ++k) {
+        for (int l = 0; l < table.m_horizontalSize; ++l) {
+            processSparseBlock(table.getBlock(k, l), table.getLastNonzero(k, l));
+        }
     }
 }
 
-Image::~Image() {
-    for (int i = 0; i < m_mcuHeight; ++i) {
-        delete[] m_imcu[i];
+#if defined(__x86_64__)
+
+// 1-D AAN IDCT on every lane, v[i] is i-th input and receive i-th output
+static inline void aanIdctSse2(__m128 *v) {
+    // even part
+    __m128 tmp10 = _mm_add_ps(v[0], v[4]);
+    __m128 tmp11 = _mm_sub_ps(v[0], v[4]);
+    __m128 tmp13 = _mm_add_ps(v[2], v[6]);
+    __m128 tmp12 = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(v[2], v[6]), _mm_set1_ps(1.414213562f)), tmp13);
+
+    __m128 tmp0 = _mm_add_ps(tmp10, tmp13);
+    __m128 tmp3 = _mm_sub_ps(tmp10, tmp13);
+    __m128 tmp1 = _mm_add_ps(tmp11, tmp12);
+    __m128 tmp2 = _mm_sub_ps(tmp11, tmp12);
+
+    // odd part
+    __m128 z13 = _mm_add_ps(v[5], v[3]);
+    __m128 z10 = _mm_sub_ps(v[5], v[3]);
+    __m128 z11 = _mm_add_ps(v[1], v[7]);
+    __m128 z12 = _mm_sub_ps(v[1], v[7]);
+
+    __m128 tmp7 = _mm_add_ps(z11, z13);
+    tmp11 = _mm_mul_ps(_mm_sub_ps(z11, z13), _mm_set1_ps(1.414213562f));
+    __m128 z5 = _mm_mul_ps(_mm_add_ps(z10, z12), _mm_set1_ps(1.847759065f));
+    tmp10 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(1.082392200f), z12), z5);
+    tmp12 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-2.613125930f), z10), z5);
+
+    __m128 tmp6 = _mm_sub_ps(tmp12, tmp7);
+    __m128 tmp5 = _mm_sub_ps(tmp11, tmp6);
+    __m128 tmp4 = _mm_add_ps(tmp10, tmp5);
+
+    v[0] = _mm_add_ps(tmp0, tmp7);
+    v[7] = _mm_sub_ps(tmp0, tmp7);
+    v[1] = _mm_add_ps(tmp1, tmp6);
+    v[6] = _mm_sub_ps(tmp1, tmp6);
+    v[2] = _mm_add_ps(tmp2, tmp5);
+    v[5] = _mm_sub_ps(tmp2, tmp5);
+    v[4] = _mm_add_ps(tmp3, tmp4);
+    v[3] = _mm_sub_ps(tmp3, tmp4);
+}
+
+// same as aanIdctSse2, but v[4] ~ v[7] are known to be zero
+static inline void aanIdctReducedSse2(__m128 *v) {
+    // even part
+    __m128 tmp12 = _mm_sub_ps(_mm_mul_ps(v[2], _mm_set1_ps(1.414213562f)), v[2]);
+
+    __m128 tmp0 = _mm_add_ps(v[0], v[2]);
+    __m128 tmp3 = _mm_sub_ps(v[0], v[2]);
+    __m128 tmp1 = _mm_add_ps(v[0], tmp12);
+    __m128 tmp2 = _mm_sub_ps(v[0], tmp12);
+
+    // odd part
+    __m128 tmp7 = _mm_add_ps(v[1], v[3]);
+    __m128 z5 = _mm_sub_ps(v[1], v[3]);
+    __m128 tmp11 = _mm_mul_ps(z5, _mm_set1_ps(1.414213562f));
+    z5 = _mm_mul_ps(z5, _mm_set1_ps(1.847759065f));
+    __m128 tmp10 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(1.082392200f), v[1]), z5);
+    tmp12 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.613125930f), v[3]), z5);
+
+    __m128 tmp6 = _mm_sub_ps(tmp12, tmp7);
+    __m128 tmp5 = _mm_sub_ps(tmp11, tmp6);
+    __m128 tmp4 = _mm_add_ps(tmp10, tmp5);
+
+    v[0] = _mm_add_ps(tmp0, tmp7);
+    v[7] = _mm_sub_ps(tmp0, tmp7);
+    v[1] = _mm_add_ps(tmp1, tmp6);
+    v[6] = _mm_sub_ps(tmp1, tmp6);
+    v[2] = _mm_add_ps(tmp2, tmp5);
+    v[5] = _mm_sub_ps(tmp2, tmp5);
+    v[4] = _mm_add_ps(tmp3, tmp4);
+    v[3] = _mm_sub_ps(tmp3, tmp4);
+}
+
+// left[i] and right[i] hold left and right half of row i
+static inline void transposeSse2(__m128 *left, __m128 *right) {
+    _MM_TRANSPOSE4_PS(left[0], left[1], left[2], left[3]);
+    _MM_TRANSPOSE4_PS(right[0], right[1], right[2], right[3]);
+    _MM_TRANSPOSE4_PS(left[4], left[5], left[6], left[7]);
+    _MM_TRANSPOSE4_PS(right[4], right[5], right[6], right[7]);
+    for (int i = 0; i < 4; ++i) {
+        std::swap(right[i], left[i + 4]);
     }
-    delete[] m_imcu;
+}
 
-    for (int i = 0; i < m_componentSize; ++i) {
-        for (int j = 0; j < m_mcuHeight * 8 * m_maxVerticalComponent; ++j) {
-            delete[] m_imageBuffer[i][j];
-        }
-        delete[] m_imageBuffer[i];
+void SIMDIDCT::performIdctOnBlockSse2(float *block) {
+    __m128 left[8], right[8];
+    for (int i = 0; i < 8; ++i) {
+        left[i] = _mm_loadu_ps(block + i * 8);
+        right[i] = _mm_loadu_ps(block + i * 8 + 4);
+    }
+    // with rows in registers, each lane run down a column
+    aanIdctSse2(left);
+    aanIdctSse2(right);
+    transposeSse2(left, right);
+    aanIdctSse2(left);
+    aanIdctSse2(right);
+    transposeSse2(left, right);
+    for (int i = 0; i < 8; ++i) {
+        _mm_storeu_ps(block + i * 8, left[i]);
+        _mm_storeu_ps(block + i * 8 + 4, right[i]);
     }
 }
 
-void NaiveUpsampling::process(JPEG &jpeg) {
-    jpeg.m_image = new Image();
-    jpeg.m_image->fromMCUS(jpeg, jpeg.m_mcus);
+void SIMDIDCT::performReducedIdctOnBlockSse2(float *block) {
+    __m128 left[8], right[8];
+    for (int i = 0; i < 4; ++i) {
+        left[i] = _mm_loadu_ps(block + i * 8);
+    }
+    // only top-left tile is nonzero, after column pass right half is still zero, so transpose only need to move left
+    // half to top half
+    aanIdctReducedSse2(left);
+    _MM_TRANSPOSE4_PS(left[0], left[1], left[2], left[3]);
+    _MM_TRANSPOSE4_PS(left[4], left[5], left[6], left[7]);
+    for (int i = 0; i < 4; ++i) {
+        right[i] = left[i + 4];
+    }
+    aanIdctReducedSse2(left);
+    aanIdctReducedSse2(right);
+    transposeSse2(left, right);
+    for (int i = 0; i < 8; ++i) {
+        _mm_storeu_ps(block + i * 8, left[i]);
+        _mm_storeu_ps(block + i * 8 + 4, right[i]);
+    }
 }
 
-Decoder &Decoder::setDequantization(IDequantization *dequantizationStrategy) {
-    m_dequantization = dequantizationStrategy;
+__attribute__((target("avx2"))) static inline void aanIdctAvx2(__m256 *v) {
+    // even part
+    __m256 tmp10 = _mm256_add_ps(v[0], v[4]);
+    __m256 tmp11 = _mm256_sub_ps(v[0], v[4]);
+    __m256 tmp13 = _mm256_add_ps(v[2], v[6]);
+    __m256 tmp12 = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(v[2], v[6]), _mm256_set1_ps(1.414213562f)), tmp13);
+
+    __m256 tmp0 = _mm256_add_ps(tmp10, tmp13);
+    __m256 tmp3 = _mm256_sub_ps(tmp10, tmp13);
+    __m256 tmp1 = _mm256_add_ps(tmp11, tmp12);
+    __m256 tmp2 = _mm256_sub_ps(tmp11, tmp12);
+
+    // odd part
+    __m256 z13 = _mm256_add_ps(v[5], v[3]);
+    __m256 z10 = _mm256_sub_ps(v[5], v[3]);
+    __m256 z11 = _mm256_add_ps(v[1], v[7]);
+    __m256 z12 = _mm256_sub_ps(v[1], v[7]);
+
+    __m256 tmp7 = _mm256_add_ps(z11, z13);
+    tmp11 = _mm256_mul_ps(_mm256_sub_ps(z11, z13), _mm256_set1_ps(1.414213562f));
+    __m256 z5 = _mm256_mul_ps(_mm256_add_ps(z10, z12), _mm256_set1_ps(1.847759065f));
+    tmp10 = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(1.082392200f), z12), z5);
+    tmp12 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(-2.613125930f), z10), z5);
+
+    __m256 tmp6 = _mm256_sub_ps(tmp12, tmp7);
+    __m256 tmp5 = _mm256_sub_ps(tmp11, tmp6);
+    __m256 tmp4 = _mm256_add_ps(tmp10, tmp5);
+
+    v[0] = _mm256_add_ps(tmp0, tmp7);
+    v[7] = _mm256_sub_ps(tmp0, tmp7);
+    v[1] = _mm256_add_ps(tmp1, tmp6);
+    v[6] = _mm256_sub_ps(tmp1, tmp6);
+    v[2] = _mm256_add_ps(tmp2, tmp5);
+    v[5] = _mm256_sub_ps(tmp2, tmp5);
+    v[4] = _mm256_add_ps(tmp3, tmp4);
+    v[3] = _mm256_sub_ps(tmp3, tmp4);
 }
 
-Decoder &Decoder::setDezigzag(IDezigzag *dezigzagStrategy) {
-    m_dezigzag = dezigzagStrategy;
+// same as aanIdctAvx2, but v[4] ~ v[7] are known to be zero
+__attribute__((target("avx2"))) static inline void aanIdctReducedAvx2(__m256 *v) {
+    // even part
+    __m256 tmp12 = _mm256_sub_ps(_mm256_mul_ps(v[2], _mm256_set1_ps(1.414213562f)), v[2]);
+
+    __m256 tmp0 = _mm256_add_ps(v[0], v[2]);
+    __m256 tmp3 = _mm256_sub_ps(v[0], v[2]);
+    __m256 tmp1 = _mm256_add_ps(v[0], tmp12);
+    __m256 tmp2 = _mm256_sub_ps(v[0], tmp12);
+
+    // odd part
+    __m256 tmp7 = _mm256_add_ps(v[1], v[3]);
+    __m256 z5 = _mm256_sub_ps(v[1], v[3]);
+    __m256 tmp11 = _mm256_mul_ps(z5, _mm256_set1_ps(1.414213562f));
+    z5 = _mm256_mul_ps(z5, _mm256_set1_ps(1.847759065f));
+    __m256 tmp10 = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(1.082392200f), v[1]), z5);
+    tmp12 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.613125930f), v[3]), z5);
+
+    __m256 tmp6 = _mm256_sub_ps(tmp12, tmp7);
+    __m256 tmp5 = _mm256_sub_ps(tmp11, tmp6);
+    __m256 tmp4 = _mm256_add_ps(tmp10, tmp5);
+
+    v[0] = _mm256_add_ps(tmp0, tmp7);
+    v[7] = _mm256_sub_ps(tmp0, tmp7);
+    v[1] = _mm256_add_ps(tmp1, tmp6);
+    v[6] = _mm256_sub_ps(tmp1, tmp6);
+    v[2] = _mm256_add_ps(tmp2, tmp5);
+    v[5] = _mm256_sub_ps(tmp2, tmp5);
+    v[4] = _mm256_add_ps(tmp3, tmp4);
+    v[3] = _mm256_sub_ps(tmp3, tmp4);
 }
 
-Decoder &Decoder::setIDCT(IIDCT *idctStrategy) {
-    m_idct = idctStrategy;
+__attribute__((target("avx2"))) static inline void transposeAvx2(__m256 *v) {
+    __m256 t[8], u[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_ps(v[i], v[i + 1]);
+        t[i + 1] = _mm256_unpackhi_ps(v[i], v[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(1, 0, 1, 0));
+        u[i + 1] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(3, 2, 3, 2));
+        u[i + 2] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(1, 0, 1, 0));
+        u[i + 3] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(3, 2, 3, 2));
+    }
+    for (int i = 0; i < 4; ++i) {
+        v[i] = _mm256_permute2f128_ps(u[i], u[i + 4], 0x20);
+        v[i + 4] = _mm256_permute2f128_ps(u[i], u[i + 4], 0x31);
+    }
 }
 
-Decoder &Decoder::setUpsampling(Upsampling *upsamplingStrategy) {
-    m_upsampling = upsamplingStrategy;
+__attribute__((target("avx2"))) void SIMDIDCT::performIdctOnBlockAvx2(float *block) {
+    __m256 v[8];
+    for (int i = 0; i < 8; ++i) {
+        v[i] = _mm256_loadu_ps(block + i * 8);
+    }
+    aanIdctAvx2(v);
+    transposeAvx2(v);
+    aanIdctAvx2(v);
+    transposeAvx2(v);
+    for (int i = 0; i < 8; ++i) {
+        _mm256_storeu_ps(block + i * 8, v[i]);
+    }
+}
+
+__attribute__((target("avx2"))) void SIMDIDCT::performReducedIdctOnBlockAvx2(float *block) {
+    __m256 v[8];
+    for (int i = 0; i < 4; ++i) {
+        v[i] = _mm256_loadu_ps(block + i * 8);
+    }
+    aanIdctReducedAvx2(v);
+    // after transpose, rows of zero coefficients go back to v[4] ~ v[7]
+    transposeAvx2(v);
+    aanIdctReducedAvx2(v);
+    transposeAvx2(v);
+    for (int i = 0; i < 8; ++i) {
+        _mm256_storeu_ps(block + i * 8, v[i]);
+    }
+}
+
+#else
+
+// without x86 intrinsics, every kernel fall back to scalar AAN IDCT
+void SIMDIDCT::performIdctOnBlockSse2(float *block) {
+    AANIDCT::performIdctOnBlock(block);
+}
+
+void SIMDIDCT::performIdctOnBlockAvx2(float *block) {
+    AANIDCT::performIdctOnBlock(block);
+}
+
+void SIMDIDCT::performReducedIdctOnBlockSse2(float *block) {
+    AANIDCT::performReducedIdctOnBlock(block, 4);
+}
+
+void SIMDIDCT::performReducedIdctOnBlockAvx2(float *block) {
+    AANIDCT::performReducedIdctOnBlock(block, 4);
 }
 
-void Decoder::process(JPEG &jpeg) {
-#ifdef DEBUG
-    int lookI = 15, lookJ = 15;
-    cout << "==== Before Process ====" << endl;
-    cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
 #endif
 
-    if (!m_dequantization) {
-        cout << "[ERROR] Didn't assign dequantization strategy." << endl;
+void IntegerIDCT::process(JPEG &jpeg) {
+    const SOF0 &sof0 = jpeg.m_sof0;
+    int mcuWidth = jpeg.m_mcus.m_mcuWidth;
+    int mcuHeight = jpeg.m_mcus.m_mcuHeight;
+    for (int i = 0; i < mcuHeight; ++i) {
+        for (int j = 0; j < mcuWidth; ++j) {
+            for (int k = 0; k < sof0.m_componentSize; ++k) {
+                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k]);
+            }
+        }
+    }
+}
+
+void IntegerIDCT::processBlock(float *block) {
+    performIdctOnBlock(block);
+}
+
+void IntegerIDCT::processSparseBlock(float *block, int lastNonzero) {
+    if (lastNonzero) {
+        performIdctOnBlock(block);
+        return;
     }
-    m_dequantization->process(jpeg);
-#ifdef DEBUG
-    cout << "==== After dequantization ====" << endl;
-    cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
-#endif
+    // dc only block goes through shortcut of both passes, which result in same value everywhere
+    int32_t value = ((int32_t) block[0] * ((int32_t) 1 << PASS1_BITS) + ((int32_t) 1 << (PASS1_BITS + 2))) >>
+                    (PASS1_BITS + 3);
+    std::fill(block, block + 64, (float) (std::min(std::max(value, (int32_t) -128), (int32_t) 127)));
+}
 
-    if (!m_dezigzag) {
-        cout << "[ERROR] Didn't provide de ZIG-ZAG strategy." << endl;
+void IntegerIDCT::performIdctOnComponentTable(ComponentTable &table) {
+    for (int k = 0; k < table.m_verticalSize; ++k) {
+        for (int l = 0; l < table.m_horizontalSize; ++l) {
+            processSparseBlock(table.getBlock(k, l), table.getLastNonzero(k, l));
+        }
     }
-    m_dezigzag->process(jpeg);
-#ifdef DEBUG
-    cout << "==== After dezigzag ====" << endl;
-    cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
-#endif
+}
 
-    if (!m_idct) {
-        cout << "[ERROR] Didn't provide IDCT strategy." << endl;
+void IntegerIDCT::performIdctOnBlock(float *block) {
+    // constants are scaled by 2^CONST_BITS
+    const int32_t FIX_0_298631336 = 2446;
+    const int32_t FIX_0_390180644 = 3196;
+    const int32_t FIX_0_541196100 = 4433;
+    const int32_t FIX_0_765366865 = 6270;
+    const int32_t FIX_0_899976223 = 7373;
+    const int32_t FIX_1_175875602 = 9633;
+    const int32_t FIX_1_501321110 = 12299;
+    const int32_t FIX_1_847759065 = 15137;
+    const int32_t FIX_1_961570560 = 16069;
+    const int32_t FIX_2_053119869 = 16819;
+    const int32_t FIX_2_562915447 = 20995;
+    const int32_t FIX_3_072711026 = 25172;
+
+    // dequantized coefficients are integer, they are converted back before transform
+    int32_t coefficient[64];
+    for (int i = 0; i < 64; ++i) {
+        coefficient[i] = (int32_t) block[i];
     }
-    m_idct->process(jpeg);
-#ifdef DEBUG
-    cout << "==== After idct ====" << endl;
-    cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
-#endif
+    int32_t workspace[64];
+    // column pass keep PASS1_BITS more bits of precision, row pass remove them together with the 1/8 scale of IDCT
+    for (int pass = 0; pass < 2; ++pass) {
+        const int32_t *input = pass ? workspace : coefficient;
+        int step = pass ? 1 : 8;
+        int stride = pass ? 8 : 1;
+        int shift = pass ? CONST_BITS + PASS1_BITS + 3 : CONST_BITS - PASS1_BITS;
+        int32_t rounding = (int32_t) 1 << (shift - 1);
+        for (int i = 0; i < 8; ++i) {
+            const int32_t *in = input + i * stride;
+            int32_t result[8];
+            if (!in[1 * step] && !in[2 * step] && !in[3 * step] && !in[4 * step] && !in[5 * step] && !in[6 * step] &&
+                !in[7 * step]) {
+                // ac terms are all zero, so output is dc term everywhere
+                int32_t value = pass ? (in[0] + ((int32_t) 1 << (PASS1_BITS + 2))) >> (PASS1_BITS + 3)
+                                     : in[0] * ((int32_t) 1 << PASS1_BITS);
+                for (int32_t &r : result) {
+                    r = value;
+                }
+            } else {
+                // even part
+                int32_t z2 = in[2 * step];
+                int32_t z3 = in[6 * step];
+                int32_t z1 = (z2 + z3) * FIX_0_541196100;
+                int32_t tmp2 = z1 + z3 * (-FIX_1_847759065);
+                int32_t tmp3 = z1 + z2 * FIX_0_765366865;
 
-    if (!m_upsampling) {
-        cout << "[ERROR] Didn't provide Upsampling strategy." << endl;
+                z2 = in[0 * step];
+                z3 = in[4 * step];
+                int32_t tmp0 = (z2 + z3) * ((int32_t) 1 << CONST_BITS);
+                int32_t tmp1 = (z2 - z3) * ((int32_t) 1 << CONST_BITS);
+
+                int32_t tmp10 = tmp0 + tmp3;
+                int32_t tmp13 = tmp0 - tmp3;
+                int32_t tmp11 = tmp1 + tmp2;
+                int32_t tmp12 = tmp1 - tmp2;
+
+                // odd part
+                tmp0 = in[7 * step];
+                tmp1 = in[5 * step];
+                tmp2 = in[3 * step];
+                tmp3 = in[1 * step];
+
+                z1 = tmp0 + tmp3;
+                z2 = tmp1 + tmp2;
+                z3 = tmp0 + tmp2;
+                int32_t z4 = tmp1 + tmp3;
+                int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+                tmp0 = tmp0 * FIX_0_298631336;
+                tmp1 = tmp1 * FIX_2_053119869;
+                tmp2 = tmp2 * FIX_3_072711026;
+                tmp3 = tmp3 * FIX_1_501321110;
+                z1 = z1 * (-FIX_0_899976223);
+                z2 = z2 * (-FIX_2_562915447);
+                z3 = z3 * (-FIX_1_961570560);
+                z4 = z4 * (-FIX_0_390180644);
+
+                z3 += z5;
+                z4 += z5;
+
+                tmp0 += z1 + z3;
+                tmp1 += z2 + z4;
+                tmp2 += z2 + z3;
+                tmp3 += z1 + z4;
+
+                result[0] = (tmp10 + tmp3 + rounding) >> shift;
+                result[7] = (tmp10 - tmp3 + rounding) >> shift;
+                result[1] = (tmp11 + tmp2 + rounding) >> shift;
+                result[6] = (tmp11 - tmp2 + rounding) >> shift;
+                result[2] = (tmp12 + tmp1 + rounding) >> shift;
+                result[5] = (tmp12 - tmp1 + rounding) >> shift;
+                result[3] = (tmp13 + tmp0 + rounding) >> shift;
+                result[4] = (tmp13 - tmp0 + rounding) >> shift;
+            }
+            if (pass) {
+                // clamp sample into 8-bit range like libjpeg, but keep it level shifted as other IDCT strategies do
+                for (int j = 0; j < 8; ++j) {
+                    block[i * 8 + j] = (float) (std::min(std::max(result[j], (int32_t) -128), (int32_t) 127));
+                }
+            } else {
+                for (int j = 0; j < 8; ++j) {
+                    workspace[j * 8 + i] = result[j];
+                }
+            }
+        }
+    }
+}
+
+ScaledIDCT::ScaledIDCT(int scaleDenominator) : m_blockSize(0), m_cosine{} {
+    if (scaleDenominator != 1 && scaleDenominator != 2 && scaleDenominator != 4 && scaleDenominator != 8) {
+        cout << "[ERROR] Unsupported scale 1/" << scaleDenominator << ", it should be 1/1, 1/2, 1/4 or 1/8." << endl;
+        exit(1);
+    }
+    m_blockSize = 8 / scaleDenominator;
+    const double pi = acos(-1);
+    for (int x = 0; x < m_blockSize; ++x) {
+        for (int u = 0; u < m_blockSize; ++u) {
+            double c = u == 0 ? 1.0 / sqrt(2.0) : 1.0;
+            m_cosine[x][u] = (float) (c / 2 * cos((2 * x + 1) * u * pi / (2 * m_blockSize)));
+        }
+    }
+}
+
+void ScaledIDCT::process(JPEG &jpeg) {
+    const SOF0 &sof0 = jpeg.m_sof0;
+    int mcuWidth = jpeg.m_mcus.m_mcuWidth;
+    int mcuHeight = jpeg.m_mcus.m_mcuHeight;
+    for (int i = 0; i < mcuHeight; ++i) {
+        for (int j = 0; j < mcuWidth; ++j) {
+            for (int k = 0; k < sof0.m_componentSize; ++k) {
+                performIdctOnComponentTable(*jpeg.m_mcus.m_mcu[i][j].m_component[k]);
+            }
+        }
+    }
+}
+
+void ScaledIDCT::processBlock(float *block) {
+    // m_blockSize-point IDCT on top-left m_blockSize x m_blockSize coefficients, first on columns then on rows
+    float workspace[64];
+    for (int u = 0; u < m_blockSize; ++u) {
+        for (int x = 0; x < m_blockSize; ++x) {
+            float sum = 0.0f;
+            for (int v = 0; v < m_blockSize; ++v) {
+                sum += m_cosine[x][v] * block[v * 8 + u];
+            }
+            workspace[x * 8 + u] = sum;
+        }
+    }
+    for (int x = 0; x < m_blockSize; ++x) {
+        for (int y = 0; y < m_blockSize; ++y) {
+            float sum = 0.0f;
+            for (int u = 0; u < m_blockSize; ++u) {
+                sum += m_cosine[y][u] * workspace[x * 8 + u];
+            }
+            block[x * 8 + y] = sum;
+        }
+    }
+}
+
+void ScaledIDCT::processSparseBlock(float *block, int lastNonzero) {
+    if (lastNonzero && m_blockSize > 1) {
+        processBlock(block);
+        return;
+    }
+    // dc only block is flat, and C(0) / 2 = 1 / (2 * sqrt(2)) in both dimensions make it dc / 8
+    float value = block[0] * 0.125f;
+    for (int x = 0; x < m_blockSize; ++x) {
+        std::fill(block + x * 8, block + x * 8 + m_blockSize, value);
+    }
+}
+
+int ScaledIDCT::getBlockSize() const {
+    return m_blockSize;
+}
+
+void ScaledIDCT::performIdctOnComponentTable(ComponentTable &table) {
+    for (int k = 0; k < table.m_verticalSize; ++k) {
+        for (int l = 0; l < table.m_horizontalSize; ++l) {
+            processSparseBlock(table.getBlock(k, l), table.getLastNonzero(k, l));
+        }
+    }
+}
+
+const ColorConverter::InterleaveMask ColorConverter::INTERLEAVE_MASK;
+
+ColorConverter::InterleaveMask::InterleaveMask() : m_value{} {
+    for (int i = 0; i < 3; ++i) {
+        for (int p = 0; p < 16; ++p) {
+            // byte p of i-th output vector is channel (16 * i + p) % 3 of pixel (16 * i + p) / 3
+            int byte = 16 * i + p;
+            for (int c = 0; c < 3; ++c) {
+                m_value[i][c][p] = byte % 3 == c ? (uint8_t) (byte / 3) : (uint8_t) 0x80;
+            }
+        }
+    }
+}
+
+ColorConverter::ColorConverter() : m_kernel(nullptr) {
+    // without x86 intrinsics, every pixel is converted by scalar kernel
+#if defined(__x86_64__)
+    // SSE2 is always available on x86-64
+    m_kernel = __builtin_cpu_supports("avx2") ? convertAvx2 : convertSse2;
+#endif
+}
+
+void ColorConverter::convert(const float *y, const float *cb, const float *cr, uint8_t *output, int count,
+                             int pixelOrder) const {
+    int converted = m_kernel ? m_kernel(y, cb, cr, output, count, pixelOrder) : 0;
+    convertScalar(y + converted, cb + converted, cr + converted, output + 3 * converted, count - converted,
+                  pixelOrder);
+}
+
+void ColorConverter::convertScalar(const float *y, const float *cb, const float *cr, uint8_t *output, int count,
+                                   int pixelOrder) {
+    // same as vector kernels: round samples to 16-bit integer, then compute in 32-bit integer
+    const int32_t offset = (128 << SCALE_BITS) + (1 << (SCALE_BITS - 1));
+    // byte offset of red and blue within a pixel
+    int rIndex = pixelOrder == BGR_ORDER ? 2 : 0;
+    int bIndex = 2 - rIndex;
+    for (int i = 0; i < count; ++i) {
+        int32_t yValue = std::min(std::max((int32_t) lrintf(y[i]), (int32_t) -32768), (int32_t) 32767);
+        int32_t cbValue = std::min(std::max((int32_t) lrintf(cb[i]), (int32_t) -32768), (int32_t) 32767);
+        int32_t crValue = std::min(std::max((int32_t) lrintf(cr[i]), (int32_t) -32768), (int32_t) 32767);
+        int32_t base = yValue * (1 << SCALE_BITS) + offset;
+        int32_t rValue = (base + crValue * CR_TO_R) >> SCALE_BITS;
+        int32_t gValue = (base + cbValue * CB_TO_G + crValue * CR_TO_G) >> SCALE_BITS;
+        int32_t bValue = (base + cbValue * CB_TO_B) >> SCALE_BITS;
+        uint8_t *pixel = output + 3 * i;
+        pixel[rIndex] = (uint8_t) std::min(std::max(rValue, (int32_t) 0), (int32_t) 255);
+        pixel[1] = (uint8_t) std::min(std::max(gValue, (int32_t) 0), (int32_t) 255);
+        pixel[bIndex] = (uint8_t) std::min(std::max(bValue, (int32_t) 0), (int32_t) 255);
+    }
+}
+
+#if defined(__x86_64__)
+
+// pair of 16-bit factor, which multiply (low, high) 16-bit pair by _mm_madd_epi16
+static inline int32_t factorPair(int low, int high) {
+    return (int32_t) (((uint32_t) (uint16_t) high << 16u) | (uint16_t) low);
+}
+
+int ColorConverter::convertSse2(const float *y, const float *cb, const float *cr, uint8_t *output, int count,
+                                int pixelOrder) {
+    // y is multiplied by 2^SCALE_BITS in the same madd, so each channel is a sum of pairs
+    const __m128i rFactor = _mm_set1_epi32(factorPair(1 << SCALE_BITS, CR_TO_R));
+    const __m128i gFactorCb = _mm_set1_epi32(factorPair(1 << SCALE_BITS, CB_TO_G));
+    const __m128i gFactorCr = _mm_set1_epi32(factorPair(0, CR_TO_G));
+    const __m128i bFactor = _mm_set1_epi32(factorPair(1 << SCALE_BITS, CB_TO_B));
+    const __m128i offset = _mm_set1_epi32((128 << SCALE_BITS) + (1 << (SCALE_BITS - 1)));
+    int rIndex = pixelOrder == BGR_ORDER ? 2 : 0;
+    int bIndex = 2 - rIndex;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i yValue = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(y + i)),
+                                         _mm_cvtps_epi32(_mm_loadu_ps(y + i + 4)));
+        __m128i cbValue = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(cb + i)),
+                                          _mm_cvtps_epi32(_mm_loadu_ps(cb + i + 4)));
+        __m128i crValue = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(cr + i)),
+                                          _mm_cvtps_epi32(_mm_loadu_ps(cr + i + 4)));
+        __m128i yCbLow = _mm_unpacklo_epi16(yValue, cbValue);
+        __m128i yCbHigh = _mm_unpackhi_epi16(yValue, cbValue);
+        __m128i yCrLow = _mm_unpacklo_epi16(yValue, crValue);
+        __m128i yCrHigh = _mm_unpackhi_epi16(yValue, crValue);
+
+        __m128i rLow = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yCrLow, rFactor), offset), SCALE_BITS);
+        __m128i rHigh = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yCrHigh, rFactor), offset), SCALE_BITS);
+        __m128i gLow = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(yCbLow, gFactorCb),
+                                                                  _mm_madd_epi16(yCrLow, gFactorCr)), offset),
+                                      SCALE_BITS);
+        __m128i gHigh = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(yCbHigh, gFactorCb),
+                                                                   _mm_madd_epi16(yCrHigh, gFactorCr)), offset),
+                                       SCALE_BITS);
+        __m128i bLow = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yCbLow, bFactor), offset), SCALE_BITS);
+        __m128i bHigh = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yCbHigh, bFactor), offset), SCALE_BITS);
+
+        // saturate to 16-bit then to unsigned 8-bit
+        __m128i rValue = _mm_packs_epi32(rLow, rHigh);
+        __m128i gValue = _mm_packs_epi32(gLow, gHigh);
+        __m128i bValue = _mm_packs_epi32(bLow, bHigh);
+        // SSE2 has no byte shuffle, so channels are interleaved from a small buffer
+        alignas(16) uint8_t channel[3][16];
+        _mm_store_si128(reinterpret_cast<__m128i *>(channel[rIndex]), _mm_packus_epi16(rValue, rValue));
+        _mm_store_si128(reinterpret_cast<__m128i *>(channel[1]), _mm_packus_epi16(gValue, gValue));
+        _mm_store_si128(reinterpret_cast<__m128i *>(channel[bIndex]), _mm_packus_epi16(bValue, bValue));
+        uint8_t *pixel = output + 3 * i;
+        for (int j = 0; j < 8; ++j) {
+            pixel[3 * j] = channel[0][j];
+            pixel[3 * j + 1] = channel[1][j];
+            pixel[3 * j + 2] = channel[2][j];
+        }
+    }
+    return i;
+}
+
+// pack two 8 x 32-bit vectors into 16 x 16-bit in order, pack works within 128-bit lane so 64-bit chunks are reordered
+__attribute__((target("avx2"))) static inline __m256i packInOrderAvx2(__m256i low, __m256i high) {
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+// saturate 16 x 16-bit into 16 x unsigned 8-bit
+__attribute__((target("avx2"))) static inline __m128i packUnsignedAvx2(__m256i value) {
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(value, value), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_castsi256_si128(packed);
+}
+
+// pick bytes of one output vector from each of 3 channels
+__attribute__((target("avx2"))) static inline __m128i interleaveAvx2(const __m128i *channel,
+                                                                     const uint8_t (*mask)[16]) {
+    __m128i value = _mm_shuffle_epi8(channel[0], _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask[0])));
+    value = _mm_or_si128(value, _mm_shuffle_epi8(channel[1],
+                                                 _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask[1]))));
+    return _mm_or_si128(value, _mm_shuffle_epi8(channel[2],
+                                                _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask[2]))));
+}
+
+__attribute__((target("avx2"))) int ColorConverter::convertAvx2(const float *y, const float *cb, const float *cr,
+                                                                uint8_t *output, int count, int pixelOrder) {
+    const __m256i rFactor = _mm256_set1_epi32(factorPair(1 << SCALE_BITS, CR_TO_R));
+    const __m256i gFactorCb = _mm256_set1_epi32(factorPair(1 << SCALE_BITS, CB_TO_G));
+    const __m256i gFactorCr = _mm256_set1_epi32(factorPair(0, CR_TO_G));
+    const __m256i bFactor = _mm256_set1_epi32(factorPair(1 << SCALE_BITS, CB_TO_B));
+    const __m256i offset = _mm256_set1_epi32((128 << SCALE_BITS) + (1 << (SCALE_BITS - 1)));
+    int rIndex = pixelOrder == BGR_ORDER ? 2 : 0;
+    int bIndex = 2 - rIndex;
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i yValue = packInOrderAvx2(_mm256_cvtps_epi32(_mm256_loadu_ps(y + i)),
+                                         _mm256_cvtps_epi32(_mm256_loadu_ps(y + i + 8)));
+        __m256i cbValue = packInOrderAvx2(_mm256_cvtps_epi32(_mm256_loadu_ps(cb + i)),
+                                          _mm256_cvtps_epi32(_mm256_loadu_ps(cb + i + 8)));
+        __m256i crValue = packInOrderAvx2(_mm256_cvtps_epi32(_mm256_loadu_ps(cr + i)),
+                                          _mm256_cvtps_epi32(_mm256_loadu_ps(cr + i + 8)));
+        // unpack and the following pack both work within 128-bit lane, so pixel order is kept
+        __m256i yCbLow = _mm256_unpacklo_epi16(yValue, cbValue);
+        __m256i yCbHigh = _mm256_unpackhi_epi16(yValue, cbValue);
+        __m256i yCrLow = _mm256_unpacklo_epi16(yValue, crValue);
+        __m256i yCrHigh = _mm256_unpackhi_epi16(yValue, crValue);
+
+        __m256i rLow = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yCrLow, rFactor), offset), SCALE_BITS);
+        __m256i rHigh = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yCrHigh, rFactor), offset), SCALE_BITS);
+        __m256i gLow = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(yCbLow, gFactorCb),
+                                                                           _mm256_madd_epi16(yCrLow, gFactorCr)),
+                                                          offset), SCALE_BITS);
+        __m256i gHigh = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(yCbHigh, gFactorCb),
+                                                                            _mm256_madd_epi16(yCrHigh, gFactorCr)),
+                                                           offset), SCALE_BITS);
+        __m256i bLow = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yCbLow, bFactor), offset), SCALE_BITS);
+        __m256i bHigh = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yCbHigh, bFactor), offset), SCALE_BITS);
+
+        __m128i channel[3];
+        channel[rIndex] = packUnsignedAvx2(_mm256_packs_epi32(rLow, rHigh));
+        channel[1] = packUnsignedAvx2(_mm256_packs_epi32(gLow, gHigh));
+        channel[bIndex] = packUnsignedAvx2(_mm256_packs_epi32(bLow, bHigh));
+        __m128i *pixel = reinterpret_cast<__m128i *>(output + 3 * i);
+        for (int j = 0; j < 3; ++j) {
+            _mm_storeu_si128(pixel + j, interleaveAvx2(channel, INTERLEAVE_MASK.m_value[j]));
+        }
+    }
+    // let SSE2 kernel take another 8 pixels
+    return i + convertSse2(y + i, cb + i, cr + i, output + 3 * i, count - i, pixelOrder);
+}
+
+#endif
+
+void ImageBlock::FromComponentTable(Arena &arena, const ComponentTable &table, int blockSize, int maxVerticalComponent,
+                                    int maxHorizontalComponent) {
+    // move component table into image MCU's block
+    // upsampling
+    m_table = arena.createArray<float *>(blockSize * maxVerticalComponent);
+    for (int i = 0; i < blockSize * maxVerticalComponent; ++i) {
+        m_table[i] = arena.createArray<float>(blockSize * maxHorizontalComponent);
+        for (int j = 0; j < blockSize * maxHorizontalComponent; ++j) {
+            int newI = i * table.m_verticalSize / maxVerticalComponent;
+            int newJ = j * table.m_horizontalSize / maxHorizontalComponent;
+            // samples of scaled block sit at its top-left, rows are still 8 values apart
+            m_table[i][j] = table.getBlock(newI / blockSize, newJ / blockSize)[(newI % blockSize) * 8 +
+                                                                                newJ % blockSize];
+        }
+    }
+}
+
+void ImageMCU::fromMCU(Arena &arena, const JPEG &jpeg, const MCU &mcu) {
+    for (int i = 0; i < jpeg.m_sof0.m_componentSize; ++i) {
+        m_block[i].FromComponentTable(arena, *mcu.m_component[i], jpeg.m_blockSize, jpeg.m_sof0.m_maxVerticalComponent,
+                                      jpeg.m_sof0.m_maxHorizontalComponent);
+    }
+}
+
+void Image::setup(const JPEG &jpeg, const MCUS &mcus) {
+    m_mcuWidth = mcus.m_mcuWidth;
+    m_mcuHeight = mcus.m_mcuHeight;
+    m_blockSize = jpeg.m_blockSize;
+    m_width = jpeg.getOutputWidth();
+    m_height = jpeg.getOutputHeight();
+    m_componentSize = jpeg.m_sof0.m_componentSize;
+    m_maxVerticalComponent = jpeg.m_sof0.m_maxVerticalComponent;
+    m_maxHorizontalComponent = jpeg.m_sof0.m_maxHorizontalComponent;
+    m_pixelOrder = jpeg.m_pixelOrder;
+}
+
+void Image::fromMCUS(const JPEG &jpeg, const MCUS &mcus) {
+    setup(jpeg, mcus);
+    m_imcu = m_arena.createArray<ImageMCU *>(m_mcuHeight);
+    for (int i = 0; i < m_mcuHeight; ++i) {
+        fromMCURow(jpeg, mcus, i);
+    }
+}
+
+void Image::fromMCURow(const JPEG &jpeg, const MCUS &mcus, int row) {
+    m_imcu[row] = m_arena.createArray<ImageMCU>(m_mcuWidth);
+    for (int j = 0; j < m_mcuWidth; ++j) {
+        m_imcu[row][j].fromMCU(m_arena, jpeg, mcus.getRow(row)[j]);
+    }
+}
+
+void Image::allocatePixels() {
+    int imageHeight = m_mcuHeight * m_blockSize * m_maxVerticalComponent;
+    int imageWidth = m_mcuWidth * m_blockSize * m_maxHorizontalComponent;
+    // buffer cover whole mcus, so that color conversion never check image edge
+    m_stride = ((size_t) imageWidth * 3 + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+    m_pixels = static_cast<uint8_t *>(m_arena.allocate(m_stride * imageHeight, ROW_ALIGNMENT));
+}
+
+void Image::convertPixels(int firstRow, int rowCount, uint8_t *output, size_t stride) const {
+    int mcuSampleHeight = m_blockSize * m_maxVerticalComponent;
+    int mcuSampleWidth = m_blockSize * m_maxHorizontalComponent;
+    int lastRow = std::min(firstRow + rowCount, m_height);
+    // convert each row of image mcu at once, leaving out columns beyond image
+    for (int i = firstRow; i < lastRow; ++i) {
+        uint8_t *row = output + (i - firstRow) * stride;
+        for (int j = 0; j < m_mcuWidth && j * mcuSampleWidth < m_width; ++j) {
+            const ImageMCU &imcu = m_imcu[i / mcuSampleHeight][j];
+            int tableI = i % mcuSampleHeight;
+            m_colorConverter.convert(imcu.m_block[0].m_table[tableI], imcu.m_block[1].m_table[tableI],
+                                     imcu.m_block[2].m_table[tableI], row + j * mcuSampleWidth * 3,
+                                     std::min(mcuSampleWidth, m_width - j * mcuSampleWidth), m_pixelOrder);
+        }
+    }
+}
+
+void Image::handleImageBuffer(const JPEG &) {
+    // compute each image mcu block into image buffer
+    if (!m_storedInBuffer) {
+        allocatePixels();
+        convertPixels(0, m_height, m_pixels, m_stride);
+        m_storedInBuffer = true;
+    }
+}
+
+void Image::toPpm(std::ofstream &ofs, const JPEG &jpeg) {
+    ofs << "P6\n";
+    ofs << m_width << " " << m_height << "\n";
+    ofs << 255 << "\n";
+    handleImageBuffer(jpeg);
+    for (int i = 0; i < m_height; ++i) {
+        const uint8_t *row = m_pixels + i * m_stride;
+        if (m_pixelOrder == ColorConverter::RGB_ORDER) {
+            ofs.write(reinterpret_cast<const char *>(row), (std::streamsize) m_width * 3);
+            continue;
+        }
+        for (int j = 0; j < m_width; ++j) {
+            ofs << row[j * 3 + 2] << row[j * 3 + 1] << row[j * 3];
+        }
+    }
+}
+
+void Image::saveToBmp(const std::string &filename, const JPEG &jpeg) {
+    // use external library to save image buffer's pixel into bmp image, which store rows in BGR order
+    handleImageBuffer(jpeg);
+    bitmap_image image(m_width, m_height);
+    for (int i = 0; i < m_height; ++i) {
+        const uint8_t *row = m_pixels + i * m_stride;
+        unsigned char *bmpRow = image.row(i);
+        if (m_pixelOrder == ColorConverter::BGR_ORDER) {
+            memcpy(bmpRow, row, (size_t) m_width * 3);
+            continue;
+        }
+        for (int j = 0; j < m_width; ++j) {
+            bmpRow[j * 3] = row[j * 3 + 2];
+            bmpRow[j * 3 + 1] = row[j * 3 + 1];
+            bmpRow[j * 3 + 2] = row[j * 3];
+        }
+    }
+    image.save_image(filename);
+}
+
+void Upsampling::process(JPEG &jpeg) {
+    Image *image = jpeg.m_arena.create<Image>(jpeg.m_arena);
+    jpeg.m_image = image;
+    image->setup(jpeg, jpeg.m_mcus);
+    image->allocatePixels();
+    prepare(jpeg);
+    processRows(jpeg, 0, image->m_mcuHeight * image->m_blockSize * image->m_maxVerticalComponent, image->m_pixels,
+                image->m_stride);
+    image->m_storedInBuffer = true;
+}
+
+void Upsampling::prepare(JPEG &) {
+    cout << "[ERROR] Upsampling strategy can't convert image row by row." << endl;
+    exit(1);
+}
+
+void Upsampling::processRows(const JPEG &, int, int, uint8_t *, size_t) {
+    cout << "[ERROR] Upsampling strategy can't convert image row by row." << endl;
+    exit(1);
+}
+
+void NaiveUpsampling::process(JPEG &jpeg) {
+    jpeg.m_image = jpeg.m_arena.create<Image>(jpeg.m_arena);
+    jpeg.m_image->fromMCUS(jpeg, jpeg.m_mcus);
+}
+
+void NaiveUpsampling::prepare(JPEG &jpeg) {
+    m_image = jpeg.m_arena.create<Image>(jpeg.m_arena);
+    m_image->setup(jpeg, jpeg.m_mcus);
+    m_image->m_imcu = jpeg.m_arena.createArray<ImageMCU *>(m_image->m_mcuHeight);
+}
+
+void NaiveUpsampling::processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) {
+    int mcuSampleHeight = jpeg.m_blockSize * jpeg.m_sof0.m_maxVerticalComponent;
+    for (int i = firstRow / mcuSampleHeight; i * mcuSampleHeight < firstRow + rowCount; ++i) {
+        m_image->fromMCURow(jpeg, jpeg.m_mcus, i);
+    }
+    m_image->convertPixels(firstRow, rowCount, output, stride);
+}
+
+// copy a row of component at its own resolution, from IDCT output blocks of every mcu in the mcu row
+static void gatherComponentRow(const JPEG &jpeg, int componentIndex, int row, float *output) {
+    int blockSize = jpeg.m_blockSize;
+    int mcuRowHeight = blockSize * (jpeg.m_sof0.m_component[componentIndex].m_sampleFactor & 0x0fu);
+    const MCU *mcuRow = jpeg.m_mcus.getRow(row / mcuRowHeight);
+    int rowInMcu = row % mcuRowHeight;
+    for (int j = 0; j < jpeg.m_mcus.m_mcuWidth; ++j) {
+        const ComponentTable &table = *mcuRow[j].m_component[componentIndex];
+        for (int k = 0; k < table.m_horizontalSize; ++k) {
+            // samples of scaled block sit at its top-left, rows are still 8 values apart
+            const float *blockRow = table.getBlock(rowInMcu / blockSize, k) + rowInMcu % blockSize * 8;
+            std::copy(blockRow, blockRow + blockSize, output);
+            output += blockSize;
+        }
+    }
+}
+
+// output[2i] = output[2i + 1] = input[i]
+static void duplicateSamples(const float *input, float *output, int count) {
+    int i = 0;
+#if defined(__x86_64__)
+    for (; i + 4 <= count; i += 4) {
+        __m128 value = _mm_loadu_ps(input + i);
+        _mm_storeu_ps(output + 2 * i, _mm_unpacklo_ps(value, value));
+        _mm_storeu_ps(output + 2 * i + 4, _mm_unpackhi_ps(value, value));
+    }
+#endif
+    for (; i < count; ++i) {
+        output[2 * i] = output[2 * i + 1] = input[i];
+    }
+}
+
+// output[i] = 3/4 * near[i] + 1/4 * far[i]
+static void blendRows(const float *near, const float *far, float *output, int count) {
+    int i = 0;
+#if defined(__x86_64__)
+    const __m128 nearFactor = _mm_set1_ps(0.75f);
+    const __m128 farFactor = _mm_set1_ps(0.25f);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(output + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(near + i), nearFactor),
+                                             _mm_mul_ps(_mm_loadu_ps(far + i), farFactor)));
+    }
+#endif
+    for (; i < count; ++i) {
+        output[i] = 0.75f * near[i] + 0.25f * far[i];
+    }
+}
+
+// output[2i] = 3/4 * input[i] + 1/4 * input[i - 1], output[2i + 1] = 3/4 * input[i] + 1/4 * input[i + 1],
+// input[-1] and input[count] must be readable
+static void triangleSamples(const float *input, float *output, int count) {
+    int i = 0;
+#if defined(__x86_64__)
+    const __m128 nearFactor = _mm_set1_ps(0.75f);
+    const __m128 farFactor = _mm_set1_ps(0.25f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 near = _mm_mul_ps(_mm_loadu_ps(input + i), nearFactor);
+        __m128 even = _mm_add_ps(near, _mm_mul_ps(_mm_loadu_ps(input + i - 1), farFactor));
+        __m128 odd = _mm_add_ps(near, _mm_mul_ps(_mm_loadu_ps(input + i + 1), farFactor));
+        _mm_storeu_ps(output + 2 * i, _mm_unpacklo_ps(even, odd));
+        _mm_storeu_ps(output + 2 * i + 4, _mm_unpackhi_ps(even, odd));
+    }
+#endif
+    for (; i < count; ++i) {
+        output[2 * i] = 0.75f * input[i] + 0.25f * input[i - 1];
+        output[2 * i + 1] = 0.75f * input[i] + 0.25f * input[i + 1];
+    }
+}
+
+void DirectUpsampling::prepare(JPEG &jpeg) {
+    int blockSize = jpeg.m_blockSize;
+    int maxHorizontalComponent = jpeg.m_sof0.m_maxHorizontalComponent;
+    int mcuSampleWidth = blockSize * maxHorizontalComponent;
+    int imageWidth = jpeg.m_mcus.m_mcuWidth * mcuSampleWidth;
+    m_componentRow = jpeg.m_arena.createArray<float>(imageWidth);
+    // grayscale image has no chroma, whose rows stay zero so that color conversion replicate luma
+    for (int c = 0; c < 3; ++c) {
+        m_row[c] = jpeg.m_arena.createArray<float>(imageWidth);
+        m_columnOffset[c] = jpeg.m_arena.createArray<int>(mcuSampleWidth);
+        int horizontalSize = jpeg.m_sof0.m_component[c].m_sampleFactor >> 4u;
+        for (int j = 0; j < mcuSampleWidth; ++j) {
+            int newJ = j * horizontalSize / maxHorizontalComponent;
+            m_columnOffset[c][j] = newJ / blockSize * 64 + newJ % blockSize;
+        }
+    }
+}
+
+void DirectUpsampling::processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) {
+    int blockSize = jpeg.m_blockSize;
+    int maxVerticalComponent = jpeg.m_sof0.m_maxVerticalComponent;
+    int maxHorizontalComponent = jpeg.m_sof0.m_maxHorizontalComponent;
+    int mcuSampleHeight = blockSize * maxVerticalComponent;
+    int mcuSampleWidth = blockSize * maxHorizontalComponent;
+    int imageWidth = jpeg.m_mcus.m_mcuWidth * mcuSampleWidth;
+    int lastRow = std::min(firstRow + rowCount, jpeg.getOutputHeight());
+    for (int i = firstRow; i < lastRow; ++i) {
+        const MCU *mcuRow = jpeg.m_mcus.getRow(i / mcuSampleHeight);
+        int mcuI = i % mcuSampleHeight;
+        for (int c = 0; c < jpeg.m_sof0.m_componentSize; ++c) {
+            int verticalSize = jpeg.m_sof0.m_component[c].m_sampleFactor & 0x0fu;
+            int horizontalSize = jpeg.m_sof0.m_component[c].m_sampleFactor >> 4u;
+            int newI = mcuI * verticalSize / maxVerticalComponent;
+            int componentRowIndex = i / mcuSampleHeight * blockSize * verticalSize + newI;
+            if (horizontalSize == maxHorizontalComponent) {
+                gatherComponentRow(jpeg, c, componentRowIndex, m_row[c]);
+            } else if (horizontalSize * 2 == maxHorizontalComponent) {
+                gatherComponentRow(jpeg, c, componentRowIndex, m_componentRow);
+                duplicateSamples(m_componentRow, m_row[c], imageWidth / 2);
+            } else {
+                for (int j = 0; j < jpeg.m_mcus.m_mcuWidth; ++j) {
+                    const ComponentTable &table = *mcuRow[j].m_component[c];
+                    const float *blockRow = table.getBlock(newI / blockSize, 0) + (newI % blockSize) * 8;
+                    float *rowOutput = m_row[c] + j * mcuSampleWidth;
+                    for (int k = 0; k < mcuSampleWidth; ++k) {
+                        rowOutput[k] = blockRow[m_columnOffset[c][k]];
+                    }
+                }
+            }
+        }
+        m_colorConverter.convert(m_row[0], m_row[1], m_row[2], output + (i - firstRow) * stride,
+                                 jpeg.getOutputWidth(), jpeg.m_pixelOrder);
+    }
+}
+
+bool MergedUpsampling::isSupported(const JPEG &jpeg) {
+    return jpeg.m_sof0.m_componentSize == 3 && jpeg.m_sof0.m_component[0].m_sampleFactor == 0x22u &&
+           jpeg.m_sof0.m_component[1].m_sampleFactor == 0x11u && jpeg.m_sof0.m_component[2].m_sampleFactor == 0x11u;
+}
+
+void MergedUpsampling::prepare(JPEG &jpeg) {
+    if (!isSupported(jpeg)) {
+        cout << "[ERROR] Merged upsampling only support 2x2 luma and 1x1 chroma sampling." << endl;
+        exit(1);
+    }
+    int imageWidth = jpeg.m_mcus.m_mcuWidth * jpeg.m_blockSize * 2;
+    m_luma[0] = jpeg.m_arena.createArray<float>(imageWidth);
+    m_luma[1] = jpeg.m_arena.createArray<float>(imageWidth);
+    m_cb = jpeg.m_arena.createArray<float>(imageWidth / 2);
+    m_cr = jpeg.m_arena.createArray<float>(imageWidth / 2);
+    m_scratch = jpeg.m_arena.createArray<uint8_t>(imageWidth * 3);
+}
+
+void MergedUpsampling::processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) {
+    int outputWidth = jpeg.getOutputWidth();
+    int lastRow = std::min(firstRow + rowCount, jpeg.getOutputHeight());
+    // mcu rows always start at even row and have even number of rows
+    for (int i = firstRow; i < lastRow; i += 2) {
+        gatherComponentRow(jpeg, 0, i, m_luma[0]);
+        gatherComponentRow(jpeg, 0, i + 1, m_luma[1]);
+        gatherComponentRow(jpeg, 1, i / 2, m_cb);
+        gatherComponentRow(jpeg, 2, i / 2, m_cr);
+        uint8_t *rowOutput[2] = {output + (i - firstRow) * stride, output + (i + 1 - firstRow) * stride};
+        // pixels outside image go to scratch row, as a pair of pixels may cross right or bottom edge
+        if (i + 1 >= lastRow) {
+            rowOutput[1] = m_scratch;
+        }
+        convertRowPair(m_luma[0], m_luma[1], m_cb, m_cr, rowOutput[0], rowOutput[1], outputWidth / 2,
+                       jpeg.m_pixelOrder);
+        if (outputWidth % 2) {
+            int last = outputWidth / 2;
+            uint8_t pixels[2][6];
+            convertRowPair(m_luma[0] + 2 * last, m_luma[1] + 2 * last, m_cb + last, m_cr + last, pixels[0],
+                           pixels[1], 1, jpeg.m_pixelOrder);
+            std::copy(pixels[0], pixels[0] + 3, rowOutput[0] + 6 * last);
+            std::copy(pixels[1], pixels[1] + 3, rowOutput[1] + 6 * last);
+        }
+    }
+}
+
+MergedUpsampling::MergedUpsampling() : m_kernel(nullptr), m_luma(), m_cb(nullptr), m_cr(nullptr),
+                                       m_scratch(nullptr) {
+    // without x86 intrinsics, every pixel is converted by scalar kernel
+#if defined(__x86_64__)
+    m_kernel = __builtin_cpu_supports("avx2") ? convertRowPairAvx2 : convertRowPairSse2;
+#endif
+}
+
+void MergedUpsampling::convertRowPair(const float *y0, const float *y1, const float *cb, const float *cr,
+                                      uint8_t *output0, uint8_t *output1, int count, int pixelOrder) const {
+    int converted = m_kernel ? m_kernel(y0, y1, cb, cr, output0, output1, count, pixelOrder) : 0;
+    convertRowPairScalar(y0 + 2 * converted, y1 + 2 * converted, cb + converted, cr + converted,
+                         output0 + 6 * converted, output1 + 6 * converted, count - converted, pixelOrder);
+}
+
+void MergedUpsampling::convertRowPairScalar(const float *y0, const float *y1, const float *cb, const float *cr,
+                                            uint8_t *output0, uint8_t *output1, int count, int pixelOrder) {
+    // same arithmetic as ColorConverter, with offset folded into chroma terms
+    const int scaleBits = ColorConverter::SCALE_BITS;
+    const int32_t offset = (128 << scaleBits) + (1 << (scaleBits - 1));
+    int rIndex = pixelOrder == ColorConverter::BGR_ORDER ? 2 : 0;
+    int bIndex = 2 - rIndex;
+    const float *y[2] = {y0, y1};
+    uint8_t *output[2] = {output0, output1};
+    for (int i = 0; i < count; ++i) {
+        int32_t cbValue = std::min(std::max((int32_t) lrintf(cb[i]), (int32_t) -32768), (int32_t) 32767);
+        int32_t crValue = std::min(std::max((int32_t) lrintf(cr[i]), (int32_t) -32768), (int32_t) 32767);
+        int32_t rTerm = crValue * ColorConverter::CR_TO_R + offset;
+        int32_t gTerm = cbValue * ColorConverter::CB_TO_G + crValue * ColorConverter::CR_TO_G + offset;
+        int32_t bTerm = cbValue * ColorConverter::CB_TO_B + offset;
+        for (int row = 0; row < 2; ++row) {
+            for (int k = 2 * i; k < 2 * i + 2; ++k) {
+                int32_t yValue = std::min(std::max((int32_t) lrintf(y[row][k]), (int32_t) -32768), (int32_t) 32767);
+                int32_t base = yValue * (1 << scaleBits);
+                uint8_t *pixel = output[row] + 3 * k;
+                pixel[rIndex] = (uint8_t) std::min(std::max((base + rTerm) >> scaleBits, (int32_t) 0), (int32_t) 255);
+                pixel[1] = (uint8_t) std::min(std::max((base + gTerm) >> scaleBits, (int32_t) 0), (int32_t) 255);
+                pixel[bIndex] = (uint8_t) std::min(std::max((base + bTerm) >> scaleBits, (int32_t) 0), (int32_t) 255);
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__)
+
+int MergedUpsampling::convertRowPairSse2(const float *y0, const float *y1, const float *cb, const float *cr,
+                                         uint8_t *output0, uint8_t *output1, int count, int pixelOrder) {
+    const __m128i rFactor = _mm_set1_epi32(factorPair(0, ColorConverter::CR_TO_R));
+    const __m128i gFactor = _mm_set1_epi32(factorPair(ColorConverter::CB_TO_G, ColorConverter::CR_TO_G));
+    const __m128i bFactor = _mm_set1_epi32(factorPair(ColorConverter::CB_TO_B, 0));
+    const int scaleBits = ColorConverter::SCALE_BITS;
+    const __m128i yFactor = _mm_set1_epi32(factorPair(1 << scaleBits, 0));
+    const __m128i offset = _mm_set1_epi32((128 << scaleBits) + (1 << (scaleBits - 1)));
+    const float *y[2] = {y0, y1};
+    uint8_t *output[2] = {output0, output1};
+    // output position of r, g and b
+    int channelIndex[3] = {0, 1, 2};
+    if (pixelOrder == ColorConverter::BGR_ORDER) {
+        std::swap(channelIndex[0], channelIndex[2]);
+    }
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // (cb, cr) pairs of 4 chroma samples
+        __m128i chroma = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(cb + i)),
+                                         _mm_cvtps_epi32(_mm_loadu_ps(cr + i)));
+        chroma = _mm_unpacklo_epi16(chroma, _mm_srli_si128(chroma, 8));
+        __m128i rTerm = _mm_add_epi32(_mm_madd_epi16(chroma, rFactor), offset);
+        __m128i gTerm = _mm_add_epi32(_mm_madd_epi16(chroma, gFactor), offset);
+        __m128i bTerm = _mm_add_epi32(_mm_madd_epi16(chroma, bFactor), offset);
+        // each chroma term is shared by two horizontally adjacent pixels
+        __m128i term[3][2] = {{_mm_unpacklo_epi32(rTerm, rTerm), _mm_unpackhi_epi32(rTerm, rTerm)},
+                              {_mm_unpacklo_epi32(gTerm, gTerm), _mm_unpackhi_epi32(gTerm, gTerm)},
+                              {_mm_unpacklo_epi32(bTerm, bTerm), _mm_unpackhi_epi32(bTerm, bTerm)}};
+        for (int row = 0; row < 2; ++row) {
+            __m128i yValue = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(y[row] + 2 * i)),
+                                             _mm_cvtps_epi32(_mm_loadu_ps(y[row] + 2 * i + 4)));
+            __m128i base[2] = {_mm_madd_epi16(_mm_unpacklo_epi16(yValue, _mm_setzero_si128()), yFactor),
+                               _mm_madd_epi16(_mm_unpackhi_epi16(yValue, _mm_setzero_si128()), yFactor)};
+            // SSE2 has no byte shuffle, so channels are interleaved from a small buffer
+            alignas(16) uint8_t channel[3][16];
+            for (int c = 0; c < 3; ++c) {
+                __m128i value = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(base[0], term[c][0]), scaleBits),
+                                                _mm_srai_epi32(_mm_add_epi32(base[1], term[c][1]), scaleBits));
+                _mm_store_si128(reinterpret_cast<__m128i *>(channel[channelIndex[c]]), _mm_packus_epi16(value, value));
+            }
+            uint8_t *pixel = output[row] + 6 * i;
+            for (int j = 0; j < 8; ++j) {
+                pixel[3 * j] = channel[0][j];
+                pixel[3 * j + 1] = channel[1][j];
+                pixel[3 * j + 2] = channel[2][j];
+            }
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) int MergedUpsampling::convertRowPairAvx2(const float *y0, const float *y1,
+                                                                         const float *cb, const float *cr,
+                                                                         uint8_t *output0, uint8_t *output1,
+                                                                         int count, int pixelOrder) {
+    const __m256i rFactor = _mm256_set1_epi32(factorPair(0, ColorConverter::CR_TO_R));
+    const __m256i gFactor = _mm256_set1_epi32(factorPair(ColorConverter::CB_TO_G, ColorConverter::CR_TO_G));
+    const __m256i bFactor = _mm256_set1_epi32(factorPair(ColorConverter::CB_TO_B, 0));
+    const int scaleBits = ColorConverter::SCALE_BITS;
+    const __m256i offset = _mm256_set1_epi32((128 << scaleBits) + (1 << (scaleBits - 1)));
+    const __m256i minimum = _mm256_set1_epi32(-32768);
+    const __m256i maximum = _mm256_set1_epi32(32767);
+    const float *y[2] = {y0, y1};
+    uint8_t *output[2] = {output0, output1};
+    // output position of r, g and b
+    int channelIndex[3] = {0, 1, 2};
+    if (pixelOrder == ColorConverter::BGR_ORDER) {
+        std::swap(channelIndex[0], channelIndex[2]);
+    }
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // (cb, cr) pairs of 8 chroma samples, pack and unpack work within 128-bit lane so order is kept
+        __m256i chroma = _mm256_packs_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(cb + i)),
+                                            _mm256_cvtps_epi32(_mm256_loadu_ps(cr + i)));
+        chroma = _mm256_unpacklo_epi16(chroma, _mm256_srli_si256(chroma, 8));
+        __m256i value[3] = {_mm256_add_epi32(_mm256_madd_epi16(chroma, rFactor), offset),
+                            _mm256_add_epi32(_mm256_madd_epi16(chroma, gFactor), offset),
+                            _mm256_add_epi32(_mm256_madd_epi16(chroma, bFactor), offset)};
+        // each chroma term is shared by two horizontally adjacent pixels, unpack duplicate within lane so halves are
+        // put back in order
+        __m256i term[3][2];
+        for (int c = 0; c < 3; ++c) {
+            __m256i low = _mm256_unpacklo_epi32(value[c], value[c]);
+            __m256i high = _mm256_unpackhi_epi32(value[c], value[c]);
+            term[c][0] = _mm256_permute2x128_si256(low, high, 0x20);
+            term[c][1] = _mm256_permute2x128_si256(low, high, 0x31);
+        }
+        for (int row = 0; row < 2; ++row) {
+            // saturate to 16-bit like ColorConverter, then scale
+            __m256i base[2];
+            for (int j = 0; j < 2; ++j) {
+                __m256i yValue = _mm256_cvtps_epi32(_mm256_loadu_ps(y[row] + 2 * i + 8 * j));
+                base[j] = _mm256_slli_epi32(_mm256_min_epi32(_mm256_max_epi32(yValue, minimum), maximum), scaleBits);
+            }
+            __m128i channel[3];
+            for (int c = 0; c < 3; ++c) {
+                channel[channelIndex[c]] = packUnsignedAvx2(
+                        packInOrderAvx2(_mm256_srai_epi32(_mm256_add_epi32(base[0], term[c][0]), scaleBits),
+                                        _mm256_srai_epi32(_mm256_add_epi32(base[1], term[c][1]), scaleBits)));
+            }
+            __m128i *pixel = reinterpret_cast<__m128i *>(output[row] + 6 * i);
+            for (int j = 0; j < 3; ++j) {
+                _mm_storeu_si128(pixel + j, interleaveAvx2(channel, ColorConverter::INTERLEAVE_MASK.m_value[j]));
+            }
+        }
+    }
+    // let SSE2 kernel take another 4 chroma samples
+    return i + convertRowPairSse2(y0 + 2 * i, y1 + 2 * i, cb + i, cr + i, output0 + 6 * i, output1 + 6 * i,
+                                  count - i, pixelOrder);
+}
+
+#endif
+
+void FancyUpsampling::prepare(JPEG &jpeg) {
+    int imageWidth = jpeg.m_mcus.m_mcuWidth * jpeg.m_blockSize * jpeg.m_sof0.m_maxHorizontalComponent;
+    m_nearRow = jpeg.m_arena.createArray<float>(imageWidth + 2) + 1;
+    m_farRow = jpeg.m_arena.createArray<float>(imageWidth + 2) + 1;
+    m_blendedRow = jpeg.m_arena.createArray<float>(imageWidth + 2) + 1;
+    // grayscale image has no chroma, whose rows stay zero so that color conversion replicate luma
+    for (int c = 0; c < 3; ++c) {
+        m_row[c] = jpeg.m_arena.createArray<float>(imageWidth);
+    }
+}
+
+void FancyUpsampling::processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) {
+    int blockSize = jpeg.m_blockSize;
+    int maxVerticalComponent = jpeg.m_sof0.m_maxVerticalComponent;
+    int maxHorizontalComponent = jpeg.m_sof0.m_maxHorizontalComponent;
+    int imageHeight = jpeg.m_mcus.m_mcuHeight * blockSize * maxVerticalComponent;
+    int imageWidth = jpeg.m_mcus.m_mcuWidth * blockSize * maxHorizontalComponent;
+    int lastRow = std::min(firstRow + rowCount, jpeg.getOutputHeight());
+    for (int i = firstRow; i < lastRow; ++i) {
+        for (int c = 0; c < jpeg.m_sof0.m_componentSize; ++c) {
+            int verticalSize = jpeg.m_sof0.m_component[c].m_sampleFactor & 0x0fu;
+            int horizontalSize = jpeg.m_sof0.m_component[c].m_sampleFactor >> 4u;
+            int verticalRatio = maxVerticalComponent / verticalSize;
+            int horizontalRatio = maxHorizontalComponent / horizontalSize;
+            // SOF0 with sampling factor which doesn't divide max sampling factor is rejected by readHeader()
+            assert(verticalRatio * verticalSize == maxVerticalComponent &&
+                   horizontalRatio * horizontalSize == maxHorizontalComponent);
+            if (verticalRatio > 2 || horizontalRatio > 2) {
+                // nearest neighbour
+                int componentRowIndex = i * verticalSize / maxVerticalComponent;
+                gatherComponentRow(jpeg, c, componentRowIndex, m_nearRow);
+                for (int j = 0; j < imageWidth; ++j) {
+                    m_row[c][j] = m_nearRow[j * horizontalSize / maxHorizontalComponent];
+                }
+                continue;
+            }
+            // samples beyond real image size are padding of encoder, edge is replicated from real samples instead
+            int componentWidth = imageWidth / horizontalRatio;
+            int componentHeight = imageHeight / verticalRatio;
+            int validWidth = (jpeg.m_sof0.m_width * horizontalSize * blockSize + maxHorizontalComponent * 8 - 1) /
+                             (maxHorizontalComponent * 8);
+            int validHeight = (jpeg.m_sof0.m_height * verticalSize * blockSize + maxVerticalComponent * 8 - 1) /
+                              (maxVerticalComponent * 8);
+            validWidth = std::min(std::max(validWidth, 1), componentWidth);
+            validHeight = std::min(std::max(validHeight, 1), componentHeight);
+            float *rowOutput = horizontalRatio == 2 ? m_blendedRow : m_row[c];
+            if (verticalRatio == 2) {
+                // even row lean on row above, odd row lean on row below
+                int near = i / 2;
+                int far = std::min(std::max(i % 2 ? near + 1 : near - 1, 0), validHeight - 1);
+                gatherComponentRow(jpeg, c, near, m_nearRow);
+                gatherComponentRow(jpeg, c, far, m_farRow);
+                blendRows(m_nearRow, m_farRow, rowOutput, componentWidth);
+            } else {
+                gatherComponentRow(jpeg, c, i, rowOutput);
+            }
+            if (horizontalRatio == 2) {
+                m_blendedRow[-1] = m_blendedRow[0];
+                m_blendedRow[componentWidth] = m_blendedRow[componentWidth - 1];
+                m_blendedRow[validWidth] = m_blendedRow[validWidth - 1];
+                triangleSamples(m_blendedRow, m_row[c], componentWidth);
+            }
+        }
+        m_colorConverter.convert(m_row[0], m_row[1], m_row[2], output + (i - firstRow) * stride,
+                                 jpeg.getOutputWidth(), jpeg.m_pixelOrder);
+    }
+}
+
+Decoder &Decoder::setDequantization(IDequantization *dequantizationStrategy) {
+    m_dequantization = dequantizationStrategy;
+    return *this;
+}
+
+Decoder &Decoder::setDezigzag(IDezigzag *dezigzagStrategy) {
+    m_dezigzag = dezigzagStrategy;
+    return *this;
+}
+
+Decoder &Decoder::setIDCT(IIDCT *idctStrategy) {
+    m_idct = idctStrategy;
+    return *this;
+}
+
+Decoder &Decoder::setUpsampling(Upsampling *upsamplingStrategy) {
+    m_upsampling = upsamplingStrategy;
+    return *this;
+}
+
+Decoder &Decoder::setFusedPipeline(bool fusedPipeline) {
+    m_fusedPipeline = fusedPipeline;
+    return *this;
+}
+
+Decoder &Decoder::setDequantizeWhileReading(bool dequantizeWhileReading) {
+    m_dequantizeWhileReading = dequantizeWhileReading;
+    return *this;
+}
+
+Decoder &Decoder::setMergedUpsampling(bool mergedUpsampling) {
+    m_mergedUpsampling = mergedUpsampling;
+    return *this;
+}
+
+Decoder &Decoder::setRowSink(IRowSink *sink) {
+    m_rowSink = sink;
+    return *this;
+}
+
+Decoder &Decoder::setPixelOrder(int pixelOrder) {
+    if (pixelOrder != ColorConverter::RGB_ORDER && pixelOrder != ColorConverter::BGR_ORDER) {
+        cout << "[ERROR] Unknown pixel order " << pixelOrder << "." << endl;
+        exit(1);
+    }
+    m_pixelOrder = pixelOrder;
+    return *this;
+}
+
+void Decoder::read(const std::string &filename, JPEG &jpeg) {
+    InputFile input;
+    if (!input.open(filename)) {
+        cout << "[ERROR] Unable to open " << filename << "." << endl;
+        exit(1);
+    }
+    read(input.getData(), input.getSize(), jpeg);
+}
+
+bool Decoder::probe(const std::string &filename, JPEG &jpeg) {
+    InputFile input;
+    if (!input.open(filename)) {
+        return false;
+    }
+    return probe(input.getData(), input.getSize(), jpeg);
+}
+
+bool Decoder::probe(const uint8_t *data, size_t size, JPEG &jpeg) {
+    ByteReader reader(data, size);
+    return jpeg.readHeader(reader);
+}
+
+void Decoder::read(const uint8_t *data, size_t size, JPEG &jpeg) {
+    prepareRead(jpeg);
+    ByteReader reader(data, size);
+    reader >> jpeg;
+    jpeg.m_componentTableHook = nullptr;
+}
+
+void Decoder::prepareRead(JPEG &jpeg) {
+    if (m_fusedPipeline) {
+        if (!m_dequantization || !m_dezigzag || !m_idct) {
+            cout << "[ERROR] Didn't provide dequantization, de ZIG-ZAG or IDCT strategy for fused pipeline." << endl;
+            exit(1);
+        }
+        jpeg.m_componentTableHook = this;
+    }
+    if (m_dequantizeWhileReading) {
+        if (!m_dequantization) {
+            cout << "[ERROR] Didn't provide dequantization strategy to dequantize while reading." << endl;
+            exit(1);
+        }
+        // hook is needed to build quantization tables at scan start
+        jpeg.m_componentTableHook = this;
+    }
+    jpeg.m_naturalOrder = m_dezigzag && m_dezigzag->isDoneWhileReading();
+    // block size and upsampling are known before reading, so that arena is sized for them
+    if (m_idct) {
+        jpeg.m_blockSize = m_idct->getBlockSize();
+    }
+    if (m_upsampling) {
+        jpeg.m_imageMcu = m_upsampling->isUsingImageMCU();
+    }
+}
+
+bool Decoder::decode(const uint8_t *data, size_t size, uint8_t *output, size_t outputSize, size_t outputStride,
+                     int *width, int *height) {
+    JPEG jpeg;
+    prepareRead(jpeg);
+    ByteReader reader(data, size);
+    if (!jpeg.readHeader(reader)) {
+        return false;
+    }
+    // output is checked once size is known from header, before compressed data is decoded
+    int outputWidth = jpeg.getOutputWidth();
+    int outputHeight = jpeg.getOutputHeight();
+    if (width) {
+        *width = outputWidth;
+    }
+    if (height) {
+        *height = outputHeight;
+    }
+    size_t rowSize = (size_t) outputWidth * 3;
+    if (!outputStride) {
+        outputStride = rowSize;
+    }
+    if (outputStride < rowSize || outputSize < outputStride * (outputHeight - 1) + rowSize) {
+        return false;
+    }
+    if (!jpeg.readScan(reader)) {
+        return false;
+    }
+    jpeg.m_componentTableHook = nullptr;
+    processCoefficients(jpeg);
+    // pixels are converted straight into output, without image buffer
+    convertRows(jpeg, *selectUpsampling(jpeg), output, outputStride);
+    return true;
+}
+
+void Decoder::onScanStart(JPEG &jpeg) {
+    m_dequantization->prepare(jpeg.m_dqt);
+    if (jpeg.m_streaming) {
+        // buffer one mcu row of pixels, with rows as wide as image buffer's
+        m_rowUpsampling = selectUpsampling(jpeg);
+        m_rowUpsampling->prepare(jpeg);
+        int imageWidth = jpeg.m_mcus.m_mcuWidth * jpeg.m_blockSize * jpeg.m_sof0.m_maxHorizontalComponent;
+        int mcuSampleHeight = jpeg.m_blockSize * jpeg.m_sof0.m_maxVerticalComponent;
+        m_rowStride = ((size_t) imageWidth * 3 + Image::ROW_ALIGNMENT - 1) / Image::ROW_ALIGNMENT *
+                      Image::ROW_ALIGNMENT;
+        m_rowPixels = static_cast<uint8_t *>(jpeg.m_arena.allocate(m_rowStride * mcuSampleHeight,
+                                                                   Image::ROW_ALIGNMENT));
+        m_rowSink->onStart(jpeg.getOutputWidth(), jpeg.getOutputHeight());
+    }
+    if (!m_dequantizeWhileReading) {
+        return;
+    }
+    // entropy decoder see coefficients in zigzag order, so factor of each component is rearranged into zigzag order
+    for (int i = 0; i < jpeg.m_sof0.m_componentSize; ++i) {
+        float table[64];
+        m_dequantization->getTable(jpeg.m_dqt, jpeg.m_sof0.m_component[i].m_dqtId, table);
+        for (int j = 0; j < 64; ++j) {
+            jpeg.m_quantization[i][j] = table[ComponentTable::NATURAL_ORDER[j]];
+        }
+    }
+}
+
+void Decoder::onComponentTable(const JPEG &jpeg, int componentIndex, ComponentTable &table) {
+    if (!m_fusedPipeline) {
+        return;
+    }
+    // process each block while it is still in cache
+    int dqtId = jpeg.m_sof0.m_component[componentIndex].m_dqtId;
+    for (int i = 0; i < table.m_verticalSize; ++i) {
+        for (int j = 0; j < table.m_horizontalSize; ++j) {
+            float *block = table.getBlock(i, j);
+            m_dezigzag->processBlock(block);
+            if (!m_dequantizeWhileReading) {
+                m_dequantization->processBlock(block, jpeg.m_dqt, dqtId);
+            }
+            m_idct->processSparseBlock(block, table.getLastNonzero(i, j));
+        }
+    }
+}
+
+void Decoder::process(JPEG &jpeg) {
+    processCoefficients(jpeg);
+    Upsampling *upsampling = selectUpsampling(jpeg);
+    if (!m_rowSink) {
+        upsampling->process(jpeg);
+        return;
+    }
+    // same as Upsampling::process(), except that each mcu row is handed to sink once it is converted, naive upsampling
+    // also build image mcus of one mcu row at a time
+    Image *image = jpeg.m_arena.create<Image>(jpeg.m_arena);
+    jpeg.m_image = image;
+    image->setup(jpeg, jpeg.m_mcus);
+    image->allocatePixels();
+    convertRows(jpeg, *upsampling, image->m_pixels, image->m_stride);
+    image->m_storedInBuffer = true;
+}
+
+void Decoder::processCoefficients(JPEG &jpeg) {
+#ifdef DEBUG
+    int lookI = 15, lookJ = 15;
+    cout << "==== Before Process ====" << endl;
+    cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
+#endif
+
+    // with fused pipeline, dezigzag, dequantization and IDCT are already done while reading
+    if (!m_fusedPipeline) {
+        if (!m_dezigzag) {
+            cout << "[ERROR] Didn't provide de ZIG-ZAG strategy." << endl;
+        }
+        m_dezigzag->process(jpeg);
+#ifdef DEBUG
+        cout << "==== After dezigzag ====" << endl;
+        cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
+#endif
+
+        if (!m_dequantizeWhileReading) {
+            if (!m_dequantization) {
+                cout << "[ERROR] Didn't assign dequantization strategy." << endl;
+            }
+            m_dequantization->process(jpeg);
+#ifdef DEBUG
+            cout << "==== After dequantization ====" << endl;
+            cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
+#endif
+        }
+
+        if (!m_idct) {
+            cout << "[ERROR] Didn't provide IDCT strategy." << endl;
+        }
+        m_idct->process(jpeg);
+#ifdef DEBUG
+        cout << "==== After idct ====" << endl;
+        cout << jpeg.m_mcus.m_mcu[lookI][lookJ];
+#endif
+    }
+
+    jpeg.m_blockSize = m_idct->getBlockSize();
+    jpeg.m_pixelOrder = m_pixelOrder;
+}
+
+void Decoder::convertRows(JPEG &jpeg, Upsampling &upsampling, uint8_t *output, size_t stride) {
+    upsampling.prepare(jpeg);
+    if (m_rowSink) {
+        m_rowSink->onStart(jpeg.getOutputWidth(), jpeg.getOutputHeight());
+    }
+    int mcuSampleHeight = jpeg.m_blockSize * jpeg.m_sof0.m_maxVerticalComponent;
+    for (int i = 0; i < jpeg.getOutputHeight(); i += mcuSampleHeight) {
+        uint8_t *pixels = output + i * stride;
+        upsampling.processRows(jpeg, i, mcuSampleHeight, pixels, stride);
+        if (m_rowSink) {
+            outputRows(jpeg, i, mcuSampleHeight, pixels, stride);
+        }
+    }
+}
+
+Upsampling *Decoder::selectUpsampling(const JPEG &jpeg) {
+    // sampling is only known after reading header, so merged upsampling is picked here
+    if (m_mergedUpsampling && MergedUpsampling::isSupported(jpeg)) {
+        return &m_merged;
+    }
+    if (!m_upsampling) {
+        cout << "[ERROR] Didn't provide Upsampling strategy." << endl;
+        exit(1);
+    }
+    return m_upsampling;
+}
+
+void Decoder::decodeRows(const std::string &filename, IRowSink &sink) {
+    InputFile input;
+    if (!input.open(filename)) {
+        cout << "[ERROR] Unable to open " << filename << "." << endl;
+        exit(1);
+    }
+    decodeRows(input.getData(), input.getSize(), sink);
+}
+
+void Decoder::decodeRows(const uint8_t *data, size_t size, IRowSink &sink) {
+    // each block must be finished while its mcu row is still kept, and upsampling must not need whole image
+    if (!m_fusedPipeline) {
+        cout << "[ERROR] Decoding row by row need fused pipeline." << endl;
+        exit(1);
+    }
+    if (!m_upsampling || m_upsampling->isUsingImageMCU()) {
+        cout << "[ERROR] Decoding row by row need an upsampling strategy which doesn't use image mcu." << endl;
+        exit(1);
+    }
+    JPEG jpeg;
+    jpeg.m_streaming = true;
+    jpeg.m_pixelOrder = m_pixelOrder;
+    IRowSink *rowSink = m_rowSink;
+    m_rowSink = &sink;
+    // rows are converted and handed to sink by onMCURow() while reading
+    read(data, size, jpeg);
+    m_rowSink = rowSink;
+    m_rowUpsampling = nullptr;
+    m_rowPixels = nullptr;
+}
+
+void Decoder::onMCURow(JPEG &jpeg, int row) {
+    if (!jpeg.m_streaming) {
+        return;
+    }
+    // triangle filter look at mcu row below, so a mcu row is converted once next one is decoded
+    if (row > 0) {
+        outputMCURow(jpeg, row - 1);
+    }
+    if (row == jpeg.m_mcus.m_mcuHeight - 1) {
+        outputMCURow(jpeg, row);
+    }
+}
+
+void Decoder::outputMCURow(const JPEG &jpeg, int row) {
+    int mcuSampleHeight = jpeg.m_blockSize * jpeg.m_sof0.m_maxVerticalComponent;
+    int firstRow = row * mcuSampleHeight;
+    m_rowUpsampling->processRows(jpeg, firstRow, mcuSampleHeight, m_rowPixels, m_rowStride);
+    outputRows(jpeg, firstRow, mcuSampleHeight, m_rowPixels, m_rowStride);
+}
+
+void Decoder::outputRows(const JPEG &jpeg, int firstRow, int rowCount, const uint8_t *pixels, size_t stride) {
+    // padding rows of last mcu row are not part of image
+    rowCount = std::min(rowCount, jpeg.getOutputHeight() - firstRow);
+    if (rowCount > 0) {
+        m_rowSink->onRows(firstRow, rowCount, pixels, stride);
     }
-    m_upsampling->process(jpeg);
 }
\ No newline at end of file
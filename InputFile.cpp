@@ -0,0 +1,128 @@
+//
+// Created by Edge on 2020/6/20.
+//
+
+#include "InputFile.h"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+InputFile::~InputFile() {
+    close();
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+bool InputFile::open(const std::string &filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat status{};
+    bool result;
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+        void *mapped = mmap(nullptr, (size_t) status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            // file is read from start to end once
+            madvise(mapped, (size_t) status.st_size, MADV_SEQUENTIAL);
+            m_mapped = mapped;
+            m_data = static_cast<const uint8_t *>(mapped);
+            m_size = (size_t) status.st_size;
+            result = true;
+        } else {
+            result = readAll(fd);
+        }
+    } else {
+        result = readAll(fd);
+    }
+    ::close(fd);
+    return result;
+}
+
+void InputFile::close() {
+    if (m_mapped) {
+        munmap(m_mapped, m_size);
+        m_mapped = nullptr;
+    }
+    std::vector<uint8_t>().swap(m_buffer);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+bool InputFile::readAll(int fd) {
+    // size of pipe is unknown, so buffer grows until end of file
+    size_t size = 0;
+    m_buffer.resize(1u << 16u);
+    while (true) {
+        if (size == m_buffer.size()) {
+            m_buffer.resize(m_buffer.size() * 2);
+        }
+        ssize_t count = ::read(fd, m_buffer.data() + size, m_buffer.size() - size);
+        if (count < 0) {
+            m_buffer.clear();
+            return false;
+        }
+        if (count == 0) {
+            break;
+        }
+        size += (size_t) count;
+    }
+    m_buffer.resize(size);
+    m_data = m_buffer.data();
+    m_size = size;
+    return true;
+}
+
+#else
+
+bool InputFile::open(const std::string &filename) {
+    // without mmap, whole file is read into buffer
+    close();
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    m_buffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    return true;
+}
+
+void InputFile::close() {
+    std::vector<uint8_t>().swap(m_buffer);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+#endif
+
+const uint8_t *InputFile::getData() const {
+    return m_data;
+}
+
+size_t InputFile::getSize() const {
+    return m_size;
+}
+
+void ByteReader::read(void *output, size_t size) {
+    if (!require(size)) {
+        memset(output, 0, size);
+        return;
+    }
+    memcpy(output, m_data + m_position, size);
+    m_position += size;
+}
+
+void ByteReader::skip(size_t size) {
+    if (require(size)) {
+        m_position += size;
+    }
+}
@@ -4,11 +4,13 @@
 
 #include <iostream>
 #include <Utility.h>
-#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include "Segment.h"
 #include "Decoder.h"
 
-using std::ifstream;
 using std::cout;
 using std::endl;
 
@@ -25,52 +27,78 @@ constexpr char JPEG::EIO_MARKER_MAGIC_NUMBER[];
 constexpr int ComponentTable::AC_ALL_ZERO;
 constexpr int ComponentTable::AC_FOLLOWING_SIXTEEN_ZERO;
 constexpr int ComponentTable::AC_NORMAL_STATE;
+constexpr int ComponentTable::BLOCK_ALIGNMENT;
+
+const uint8_t ComponentTable::NATURAL_ORDER[64] = {
+        0, 1, 8, 16, 9, 2, 3, 10,
+        17, 24, 32, 25, 18, 11, 4, 5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63
+};
+
+const uint8_t ComponentTable::ZIGZAG_ORDER[64] = {
+        0, 1, 2, 3, 4, 5, 6, 7,
+        8, 9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23,
+        24, 25, 26, 27, 28, 29, 30, 31,
+        32, 33, 34, 35, 36, 37, 38, 39,
+        40, 41, 42, 43, 44, 45, 46, 47,
+        48, 49, 50, 51, 52, 53, 54, 55,
+        56, 57, 58, 59, 60, 61, 62, 63
+};
+constexpr int HuffmanTable::LOOKAHEAD_BITS;
 constexpr int JPEG::AC_COMPONENT;
 constexpr int JPEG::DC_COMPONENT;
 
-std::ifstream &operator>>(std::ifstream &ifs, ColorType &data) {
-    ifs >> data.r;
-    ifs >> data.g;
-    ifs >> data.b;
-    return ifs;
+ByteReader &operator>>(ByteReader &reader, ColorType &data) {
+    reader >> data.r;
+    reader >> data.g;
+    reader >> data.b;
+    return reader;
 }
 
 bool APP0::checkSegment(const char header[]) {
     return checkData(header, APP0::MARKER_MAGIC_NUMBER, sizeof(APP0::MARKER_MAGIC_NUMBER));
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, APP0 &data) {
+ByteReader &operator>>(ByteReader &reader, APP0 &data) {
     uint16_t length;
-    ifs >> length;
+    reader >> length;
     // subtract length itself size
     length -= 2;
     char identifier[6];
-    readData(ifs, identifier, sizeof(APP0::IDENTIFIER_MAGIC_NUMBER) - 1);
+    readData(reader, identifier, sizeof(APP0::IDENTIFIER_MAGIC_NUMBER) - 1);
     if (!checkData(identifier, APP0::IDENTIFIER_MAGIC_NUMBER, sizeof(APP0::IDENTIFIER_MAGIC_NUMBER))) {
-        cout << "[ERROR] APP0 identifier mismatch." << endl;
-        exit(1);
+        reader.fail();
+        return reader;
     }
     // subtract identifier length
     length -= 5;
-    ifs >> data.m_version;
-    ifs >> data.m_densityUnit;
-    ifs >> data.m_xDensity;
-    ifs >> data.m_yDensity;
-    ifs >> data.m_xThumbnail;
-    ifs >> data.m_yThumbnail;
+    reader >> data.m_version;
+    reader >> data.m_densityUnit;
+    reader >> data.m_xDensity;
+    reader >> data.m_yDensity;
+    reader >> data.m_xThumbnail;
+    reader >> data.m_yThumbnail;
 
     // store thumbnail
     int thumbnailSize = data.m_xThumbnail * data.m_yThumbnail;
     if (thumbnailSize) {
         data.m_thumbnailData = new Color[thumbnailSize];
         for (int i = 0; i < thumbnailSize; ++i) {
-            ifs >> data.m_thumbnailData[i];
+            reader >> data.m_thumbnailData[i];
         }
     }
     length -= 9 + thumbnailSize * sizeof(Color);
-    assert(length == 0);
+    if (length != 0) {
+        reader.fail();
+    }
 
-    return ifs;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const APP0 &data) {
@@ -94,17 +122,17 @@ bool COM::checkSegment(const char header[]) {
     return checkData(header, COM::MARKER_MAGIC_NUMBER, sizeof(COM::MARKER_MAGIC_NUMBER));
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, COM &data) {
+ByteReader &operator>>(ByteReader &reader, COM &data) {
     uint16_t length;
-    ifs >> length;
+    reader >> length;
     length -= 2;
     // read in comment
     char *comment = new char[length + 1];
-    ifs.read(comment, length);
+    reader.read(comment, length);
     comment[length] = 0;
     data.m_comment = comment;
     delete[] comment;
-    return ifs;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const COM &data) {
@@ -118,31 +146,39 @@ bool DQT::checkSegment(const char header[]) {
     return checkData(header, DQT::MARKER_MAGIC_NUMBER, sizeof(DQT::MARKER_MAGIC_NUMBER));
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, DQT &data) {
+ByteReader &operator>>(ByteReader &reader, DQT &data) {
     uint16_t length;
-    ifs >> length;
+    reader >> length;
     length -= 2;
-    while (length > 0) {
+    while (length > 0 && !reader.hasFailed()) {
         // read in precision (higher 4 bit, 0 indicate 8-bit, 1 indicate 16-bit) and id (lower 4 bit)
         uint8_t precisionAndType;
-        ifs >> precisionAndType;
+        reader >> precisionAndType;
+        if ((precisionAndType & 0x0fu) > 3) {
+            reader.fail();
+            break;
+        }
         data.m_PTq[precisionAndType & 0x0fu] = precisionAndType;
         // Quantization table
         data.m_qs[precisionAndType & 0x0fu] = (precisionAndType & 0xf0u)
                                               ? (void *) (new uint16_t[64])
                                               : (void *) (new uint8_t[64]);
+        // table is stored in zigzag order, put them back to natural order
         for (int i = 0; i < 64; ++i) {
+            int position = ComponentTable::NATURAL_ORDER[i];
             if ((precisionAndType & 0xf0u)) {
-                ifs >> ((uint16_t *) data.m_qs[precisionAndType & 0x0fu])[i];
+                reader >> ((uint16_t *) data.m_qs[precisionAndType & 0x0fu])[position];
             } else {
-                ifs >> ((uint8_t *) data.m_qs[precisionAndType & 0x0fu])[i];
+                reader >> ((uint8_t *) data.m_qs[precisionAndType & 0x0fu])[position];
             }
         }
         length -= 1 + 64 * (((precisionAndType & 0xf0u) >> 4u) + 1);
     }
-    assert(length == 0);
+    if (length != 0) {
+        reader.fail();
+    }
 
-    return ifs;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const DQT &data) {
@@ -180,12 +216,12 @@ DQT::~DQT() {
     }
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, ColorComponent &data) {
-    ifs >> data.m_id;
+ByteReader &operator>>(ByteReader &reader, ColorComponent &data) {
+    reader >> data.m_id;
     // horizontal (higher 4 bit), vertical sampling factor (lower 4 bit)
-    ifs >> data.m_sampleFactor;
-    ifs >> data.m_dqtId;
-    return ifs;
+    reader >> data.m_sampleFactor;
+    reader >> data.m_dqtId;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const ColorComponent &data) {
@@ -199,30 +235,58 @@ bool SOF0::checkSegment(const char header[]) {
     return checkData(header, SOF0::MARKER_MAGIC_NUMBER, sizeof(SOF0::MARKER_MAGIC_NUMBER));
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, SOF0 &data) {
+ByteReader &operator>>(ByteReader &reader, SOF0 &data) {
     uint16_t length;
-    ifs >> length;
+    reader >> length;
     length -= 2;
 
-    ifs >> data.m_precision;
-    ifs >> data.m_height;
-    ifs >> data.m_width;
-    ifs >> data.m_componentSize;
-    data.m_maxHorizontalComponent = data.m_maxVerticalComponent = 0;
+    reader >> data.m_precision;
+    reader >> data.m_height;
+    reader >> data.m_width;
+    reader >> data.m_componentSize;
+    if (!data.m_width || !data.m_height || data.m_componentSize < 1 || data.m_componentSize > 4) {
+        reader.fail();
+        return reader;
+    }
+    // components are stored by id, so ids must be 1 to component size without repeat
+    unsigned int idFound = 0;
     for (int i = 0; i < (int) data.m_componentSize; ++i) {
         ColorComponent colorComponent{};
-        ifs >> colorComponent;
+        reader >> colorComponent;
+        if (colorComponent.m_id < 1 || colorComponent.m_id > data.m_componentSize ||
+            (idFound & (1u << colorComponent.m_id))) {
+            reader.fail();
+            return reader;
+        }
+        idFound |= 1u << colorComponent.m_id;
         data.m_component[colorComponent.m_id - 1] = colorComponent;
+    }
+    data.m_maxHorizontalComponent = data.m_maxVerticalComponent = 0;
+    for (int i = 0; i < (int) data.m_componentSize; ++i) {
+        uint8_t horizontal = (data.m_component[i].m_sampleFactor >> 4u);
+        uint8_t vertical = (data.m_component[i].m_sampleFactor & 0x0fu);
+        if (horizontal < 1 || horizontal > 4 || vertical < 1 || vertical > 4) {
+            reader.fail();
+            return reader;
+        }
         // select max horizontal sampling factor as sampling factor per mcu
-        data.m_maxHorizontalComponent = std::max(data.m_maxHorizontalComponent,
-                                                 (uint8_t) (data.m_component[i].m_sampleFactor >> 4u));
+        data.m_maxHorizontalComponent = std::max(data.m_maxHorizontalComponent, horizontal);
         // select max vertical sampling factor as sampling factor per mcu
-        data.m_maxVerticalComponent = std::max(data.m_maxVerticalComponent,
-                                               (uint8_t) (data.m_component[i].m_sampleFactor & 0x0fu));
+        data.m_maxVerticalComponent = std::max(data.m_maxVerticalComponent, vertical);
+    }
+    // upsampling replicate each sample of a component by a whole number of pixels
+    for (int i = 0; i < (int) data.m_componentSize; ++i) {
+        if (data.m_maxHorizontalComponent % (data.m_component[i].m_sampleFactor >> 4u) ||
+            data.m_maxVerticalComponent % (data.m_component[i].m_sampleFactor & 0x0fu)) {
+            reader.fail();
+            return reader;
+        }
     }
     length -= 6 + data.m_componentSize * sizeof(ColorComponent);
-    assert(length == 0);
-    return ifs;
+    if (length != 0) {
+        reader.fail();
+    }
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const SOF0 &data) {
@@ -238,13 +302,13 @@ std::ostream &operator<<(std::ostream &os, const SOF0 &data) {
     return os;
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, HuffmanTable &data) {
-    ifs >> data.m_typeAndId;
+ByteReader &operator>>(ByteReader &reader, HuffmanTable &data) {
+    reader >> data.m_typeAndId;
     // Huffman table
     data.m_length += 1;
     data.m_length += 16;
     for (int i = 1; i <= 16; ++i) {
-        ifs >> data.m_codeAmountOfBit[i];
+        reader >> data.m_codeAmountOfBit[i];
         data.m_length += data.m_codeAmountOfBit[i];
         // canonical huffman table
         // accelerate getCode() table lookup using pre-calculated start address of each codeword length
@@ -257,10 +321,11 @@ std::ifstream &operator>>(std::ifstream &ifs, HuffmanTable &data) {
     }
     for (int i = 1; i <= 16; ++i) {
         for (int j = 0; j < data.m_codeAmountOfBit[i]; ++j) {
-            ifs >> data.m_codeword[i][j];
+            reader >> data.m_codeword[i][j];
         }
     }
-    return ifs;
+    data.buildLookup();
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const HuffmanTable &data) {
@@ -300,6 +365,62 @@ bool HuffmanTable::getCode(uint16_t codeword, int length, uint8_t &output) const
     return false;
 }
 
+uint8_t HuffmanTable::decode(BitReader &reader) const {
+    reader.ensure(16);
+    // most codeword are short, so decode it by single look up of next LOOKAHEAD_BITS bits
+    uint16_t entry = m_lookup[reader.peek(LOOKAHEAD_BITS)];
+    if (entry >> 8u) {
+        reader.skip(entry >> 8u);
+        return (uint8_t) (entry & 0xffu);
+    }
+    // codeword is longer than LOOKAHEAD_BITS, fallback to walk through canonical huffman table
+    uint8_t output;
+    for (int i = LOOKAHEAD_BITS + 1; i <= 16; ++i) {
+        if (getCode(reader.peek(i), i, output)) {
+            reader.skip(i);
+            return output;
+        }
+    }
+    reader.fail();
+    return 0;
+}
+
+void HuffmanTable::buildLookup() {
+    // codeword of length i occupy every look up entry which is prefixed by it, and those entries store codeword length and
+    // the decoded word
+    for (int i = 1; i <= LOOKAHEAD_BITS; ++i) {
+        for (uint32_t j = 0; j < m_codeAmountOfBit[i] && m_table[i] + j < (1u << i); ++j) {
+            uint32_t start = (m_table[i] + j) << (LOOKAHEAD_BITS - i);
+            for (uint32_t k = 0; k < (1u << (LOOKAHEAD_BITS - i)); ++k) {
+                m_lookup[start + k] = (uint16_t) ((i << 8u) | m_codeword[i][j]);
+            }
+        }
+    }
+    if (getType() != JPEG::AC_COMPONENT) {
+        return;
+    }
+    // for ac table, if coefficient bits following the codeword also fit in look up bits, convert them into coefficient
+    // in advance, so that single look up can emit a finished coefficient
+    for (uint32_t i = 0; i < (1u << LOOKAHEAD_BITS); ++i) {
+        int codeLength = (m_lookup[i] >> 8u);
+        uint8_t output = (uint8_t) (m_lookup[i] & 0xffu);
+        int coefficientLength = (output & 0x0fu);
+        if (!codeLength || !coefficientLength || codeLength + coefficientLength > LOOKAHEAD_BITS) {
+            continue;
+        }
+        int totalLength = codeLength + coefficientLength;
+        uint32_t rawCoefficient = (i >> (LOOKAHEAD_BITS - totalLength)) & ((1u << coefficientLength) - 1);
+        // like 1's complement, if first bit is 0, then it is negative
+        if ((rawCoefficient >> (coefficientLength - 1)) == 0) {
+            m_acLookup[i].value = (int16_t) ((int) rawCoefficient - (1 << coefficientLength) + 1);
+        } else {
+            m_acLookup[i].value = (int16_t) rawCoefficient;
+        }
+        m_acLookup[i].trailingZero = (output >> 4u);
+        m_acLookup[i].length = (uint8_t) totalLength;
+    }
+}
+
 HuffmanTable::~HuffmanTable() {
     for (int i = 1; i <= 16; ++i) {
         if (m_codeAmountOfBit[i]) {
@@ -322,20 +443,27 @@ bool DHT::checkSegment(const char header[]) {
     return checkData(header, DHT::MARKER_MAGIC_NUMBER, sizeof(DHT::MARKER_MAGIC_NUMBER));
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, DHT &data) {
+ByteReader &operator>>(ByteReader &reader, DHT &data) {
     uint16_t length;
-    ifs >> length;
+    reader >> length;
     length -= 2;
 
-    while (length > 0) {
+    while (length > 0 && !reader.hasFailed()) {
         HuffmanTable *newHuffmanTable = new HuffmanTable();
-        ifs >> *newHuffmanTable;
+        reader >> *newHuffmanTable;
+        if (newHuffmanTable->getType() > 1 || newHuffmanTable->getId() > 1) {
+            delete newHuffmanTable;
+            reader.fail();
+            break;
+        }
         data.m_huffmanTable[newHuffmanTable->getType()][newHuffmanTable->getId()] = newHuffmanTable;
         length -= data.m_huffmanTable[newHuffmanTable->getType()][newHuffmanTable->getId()]->getTableLength();
     }
-    assert(length == 0);
+    if (length != 0) {
+        reader.fail();
+    }
 
-    return ifs;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const DHT &data) {
@@ -355,12 +483,12 @@ bool DRI::checkSegment(const char header[]) {
     return checkData(header, DRI::MARKER_MAGIC_NUMBER, sizeof(DRI::MARKER_MAGIC_NUMBER));
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, DRI &data) {
+ByteReader &operator>>(ByteReader &reader, DRI &data) {
     uint16_t length;
-    ifs >> length;
+    reader >> length;
 
-    ifs >> data.m_restartInterval;
-    return ifs;
+    reader >> data.m_restartInterval;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const DRI &data) {
@@ -370,10 +498,10 @@ std::ostream &operator<<(std::ostream &os, const DRI &data) {
     return os;
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, DHTComponent &data) {
-    ifs >> data.m_id;
-    ifs >> data.m_dcac;
-    return ifs;
+ByteReader &operator>>(ByteReader &reader, DHTComponent &data) {
+    reader >> data.m_id;
+    reader >> data.m_dcac;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const DHTComponent &data) {
@@ -387,20 +515,29 @@ bool SOS::checkSegment(const char header[]) {
     return checkData(header, SOS::MARKER_MAGIC_NUMBER, sizeof(SOS::MARKER_MAGIC_NUMBER));
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, SOS &data) {
+ByteReader &operator>>(ByteReader &reader, SOS &data) {
     uint16_t length;
-    ifs >> length;
+    reader >> length;
 
-    ifs >> data.m_componentSize;
+    reader >> data.m_componentSize;
+    if (data.m_componentSize > 4) {
+        reader.fail();
+        return reader;
+    }
     for (int i = 0; i < data.m_componentSize; ++i) {
         DHTComponent dhtComponent{};
-        ifs >> dhtComponent;
+        reader >> dhtComponent;
+        if (dhtComponent.m_id < 1 || dhtComponent.m_id > 4 || (dhtComponent.m_dcac >> 4u) > 1 ||
+            (dhtComponent.m_dcac & 0x0fu) > 1) {
+            reader.fail();
+            return reader;
+        }
         data.m_component[dhtComponent.m_id - 1] = dhtComponent;
     }
-    ifs >> data.m_spectrumSelectionStart;
-    ifs >> data.m_spectrumSelectionEnd;
-    ifs >> data.m_spectrumSelection;
-    return ifs;
+    reader >> data.m_spectrumSelectionStart;
+    reader >> data.m_spectrumSelectionEnd;
+    reader >> data.m_spectrumSelection;
+    return reader;
 }
 
 std::ostream &operator<<(std::ostream &os, const SOS &data) {
@@ -417,107 +554,150 @@ std::ostream &operator<<(std::ostream &os, const SOS &data) {
     return os;
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, BitStreamBuffer &data) {
-    if (data.m_readLength == 8) {
-        ifs >> data.m_buffer;
-        uint8_t dummy;
-        if (data.m_buffer == 0xFF) {
-            ifs >> dummy;
+void BitReader::refill() {
+    // number of whole bytes which can still be put into buffer
+    int byteCount = (64 - m_length) >> 3u;
+    if (!m_markerReached && m_position + 8 <= m_size) {
+        // load next 8 bytes at once, if none of the bytes going to be used is 0xFF, there is neither stuffed zero byte
+        // nor marker, so they can be appended to buffer together
+        uint64_t word = 0;
+        for (int i = 0; i < 8; ++i) {
+            word = (word << 8u) | m_data[m_position + i];
+        }
+        uint64_t inverted = ~word;
+        uint64_t hasFF = (inverted - 0x0101010101010101ull) & ~inverted & 0x8080808080808080ull;
+        uint64_t usedMask = ~0ull << (64u - 8u * byteCount);
+        if (!(hasFF & usedMask)) {
+            m_buffer |= (word & usedMask) >> m_length;
+            m_length += 8 * byteCount;
+            m_position += byteCount;
+            return;
+        }
+    }
+    // slow path, pull byte by byte to handle stuffed zero byte and marker
+    while (m_length <= 56) {
+        uint8_t byte = 0;
+        if (!m_markerReached && m_position < m_size) {
+            byte = m_data[m_position];
+            if (byte != 0xFF) {
+                ++m_position;
+            } else if (m_position + 1 < m_size && m_data[m_position + 1] == 0x00) {
+                // skip stuffed zero byte
+                m_position += 2;
+            } else {
+                // meet a marker, leave it so that it can be read as header afterward
+                byte = 0;
+                m_markerReached = true;
+            }
         }
-        data.m_readLength = 0;
+        m_buffer |= (uint64_t) byte << (56u - m_length);
+        m_length += 8;
     }
-    return ifs;
 }
 
-int BitStream::putWord(BitStreamBuffer &input, int length) {
-    int bitToRead = std::min(8 - input.m_readLength, length);
-    // put corresponding length of bit in input into bitstream
-    // if there are some remaining bit not read from input
-    // output remaining bit to read
-    m_buffer <<= bitToRead;
-    m_buffer |= ((input.m_buffer >> ((8 - input.m_readLength) - bitToRead)) & ((1 << bitToRead) - 1));
-    m_length += bitToRead;
-    input.m_readLength += bitToRead;
-    return length - bitToRead;
+void BitReader::ensure(int length) {
+    if (m_length < length) {
+        refill();
+    }
 }
 
-void BitStream::clear() {
-    m_buffer = 0;
-    m_length = 0;
+uint32_t BitReader::peek(int length) const {
+    return (uint32_t) (m_buffer >> (64u - length));
 }
 
-int BitStream::getLength() const {
-    return m_length;
+void BitReader::skip(int length) {
+    m_buffer <<= length;
+    m_length -= length;
 }
 
-uint16_t BitStream::getWord() const {
-    return m_buffer;
+uint32_t BitReader::get(int length) {
+    ensure(length);
+    uint32_t bits = peek(length);
+    skip(length);
+    return bits;
 }
 
-void ComponentTable::init(uint8_t verticalSize, uint8_t horizontalSize) {
+void ComponentTable::init(Arena &arena, uint8_t verticalSize, uint8_t horizontalSize) {
     m_verticalSize = verticalSize;
     m_horizontalSize = horizontalSize;
-    for (int i = 0; i < 8; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            m_table[i][j] = new float *[verticalSize];
-            for (int k = 0; k < verticalSize; ++k) {
-                m_table[i][j][k] = new float[horizontalSize];
-            }
-        }
-    }
+    // all blocks of this component share single aligned allocation, each block is 64 consecutive values
+    m_table = static_cast<float *>(arena.allocate((size_t) verticalSize * horizontalSize * 64 * sizeof(float),
+                                                  BLOCK_ALIGNMENT));
+    m_lastNonzero = arena.createArray<uint8_t>((size_t) verticalSize * horizontalSize);
+}
+
+float *ComponentTable::getBlock(int verticalComponent, int horizonComponent) {
+    return m_table + (verticalComponent * m_horizontalSize + horizonComponent) * 64;
+}
+
+const float *ComponentTable::getBlock(int verticalComponent, int horizonComponent) const {
+    return m_table + (verticalComponent * m_horizontalSize + horizonComponent) * 64;
 }
 
-void ComponentTable::read(std::ifstream &ifs, float lastComponentDcValue, const HuffmanTable &dcTable,
-                          const HuffmanTable &acTable, BitStreamBuffer &bsb) {
+int ComponentTable::getLastNonzero(int verticalComponent, int horizonComponent) const {
+    return m_lastNonzero[verticalComponent * m_horizontalSize + horizonComponent];
+}
+
+bool ComponentTable::read(BitReader &reader, float &dcPredictor, const HuffmanTable &dcTable,
+                          const HuffmanTable &acTable, const uint8_t *coefficientOrder,
+                          const float *quantization) {
 
     for (int i = 0; i < m_verticalSize; ++i) {
         for (int j = 0; j < m_horizontalSize; ++j) {
+            float *block = getBlock(i, j);
+            // clear block first, so that only nonzero coefficients need to be placed
+            std::fill(block, block + 64, 0.0f);
             uint32_t count = 1;
+            uint32_t lastNonzero = 0;
             // first element of corresponding table is dc
-            m_table[0][0][i][j] = readDc(ifs, dcTable, bsb);
-            // if this is not in first mcu, then it must contain its previous mcu's component dc value
-            m_table[0][0][i][j] += lastComponentDcValue;
-            lastComponentDcValue = m_table[0][0][i][j];
+            // dc value is stored as difference from previous component's dc value
+            dcPredictor += readDc(reader, dcTable);
+            block[0] = dcPredictor * quantization[0];
             // the remaining element are ac value
             while (count < 64) {
-                ComponentTable::ACValue acValue = readAc(ifs, acTable, bsb);
+                ComponentTable::ACValue acValue = readAc(reader, acTable);
                 switch (acValue.state) {
                     case AC_ALL_ZERO : {
-                        while (count < 64) {
-                            m_table[count >> 3u][count & 0x07u][i][j] = 0.0;
-                            ++count;
-                        }
+                        count = 64;
                         break;
                     }
                     case AC_FOLLOWING_SIXTEEN_ZERO : {
-                        for (int k = 0; k < 16; ++k) {
-                            m_table[count >> 3u][count & 0x07u][i][j] = 0.0;
-                            ++count;
-                        }
+                        count += 16;
                         break;
                     }
                     case AC_NORMAL_STATE : {
-                        for (int k = 0; k < acValue.trailingZero; ++k) {
-                            m_table[count >> 3u][count & 0x07u][i][j] = 0.0;
-                            ++count;
+                        count += acValue.trailingZero;
+                        if (count >= 64) {
+                            // run past end of block
+                            reader.fail();
+                            return false;
+                        }
+                        block[coefficientOrder[count]] = acValue.value * quantization[count];
+                        if (acValue.value != 0) {
+                            lastNonzero = count;
                         }
-                        m_table[count >> 3u][count & 0x07u][i][j] = acValue.value;
                         ++count;
                         break;
                     }
                 }
             }
+            m_lastNonzero[i * m_horizontalSize + j] = (uint8_t) lastNonzero;
+            if (reader.hasFailed()) {
+                return false;
+            }
         }
     }
+    return true;
 }
 
 std::ostream &operator<<(std::ostream &os, const ComponentTable &data) {
     for (int i = 0; i < data.m_verticalSize; ++i) {
         for (int j = 0; j < data.m_horizontalSize; ++j) {
             os << "=========== Sample of (" << i << ", " << j << ") Start =========" << std::endl;
+            const float *block = data.getBlock(i, j);
             for (int k = 0; k < 8; ++k) {
                 for (int l = 0; l < 8; ++l) {
-                    os << data.m_table[k][l][i][j] << " ";
+                    os << block[k * 8 + l] << " ";
                 }
                 os << std::endl;
             }
@@ -529,63 +709,67 @@ std::ostream &operator<<(std::ostream &os, const ComponentTable &data) {
 
 void ComponentTable::multiplyWith(const DQT &dqt, int tableIndex) {
     // multiply component table with dqt
+    int blockCount = m_verticalSize * m_horizontalSize;
+    for (int i = 0; i < blockCount; ++i) {
+        multiplyBlockWith(m_table + i * 64, dqt, tableIndex);
+    }
+}
+
+void ComponentTable::multiplyBlockWith(float *block, const DQT &dqt, int tableIndex) {
     if ((dqt.m_PTq[tableIndex] >> 4u)) {
         const uint16_t *dqtTable = reinterpret_cast<uint16_t *>(dqt.m_qs[tableIndex]);
-        for (int i = 0; i < 8; ++i) {
-            for (int j = 0; j < 8; ++j) {
-                for (int k = 0; k < m_verticalSize; ++k) {
-                    for (int l = 0; l < m_horizontalSize; ++l) {
-                        m_table[i][j][k][l] *= (float) dqtTable[i * 8 + j];
-                    }
-                }
-            }
+        for (int i = 0; i < 64; ++i) {
+            block[i] *= (float) dqtTable[i];
         }
     } else {
         const uint8_t *dqtTable = reinterpret_cast<uint8_t *>(dqt.m_qs[tableIndex]);
-        for (int i = 0; i < 8; ++i) {
-            for (int j = 0; j < 8; ++j) {
-                for (int k = 0; k < m_verticalSize; ++k) {
-                    for (int l = 0; l < m_horizontalSize; ++l) {
-                        m_table[i][j][k][l] *= (float) dqtTable[i * 8 + j];
-                    }
-                }
-            }
+        for (int i = 0; i < 64; ++i) {
+            block[i] *= (float) dqtTable[i];
         }
     }
 }
 
-void ComponentTable::replaceWith(const ComponentTable &table, int (*replaceTable)[8]) {
-    // replace with another component table using replace table
+void ComponentTable::replaceWith(int (*replaceTable)[8]) {
+    // replace with copy of original block using replace table
+    int blockCount = m_verticalSize * m_horizontalSize;
+    for (int i = 0; i < blockCount; ++i) {
+        replaceBlockWith(m_table + i * 64, replaceTable);
+    }
+}
+
+void ComponentTable::replaceBlockWith(float *block, int (*replaceTable)[8]) {
+    float replaceBlock[64];
+    std::copy(block, block + 64, replaceBlock);
     for (int i = 0; i < 8; ++i) {
         for (int j = 0; j < 8; ++j) {
-            for (int k = 0; k < m_verticalSize; ++k) {
-                for (int l = 0; l < m_horizontalSize; ++l) {
-                    uint8_t replacePosition = replaceTable[i][j];
-                    m_table[i][j][k][l] = table.m_table[replacePosition >> 3u][replacePosition & 0x7u][k][l];
-                }
-            }
+            block[i * 8 + j] = replaceBlock[replaceTable[i][j]];
         }
     }
 }
 
 void ComponentTable::inPlaceReplaceWith(int (*swapTable)[8]) {
     // in place swap using swap table
+    int blockCount = m_verticalSize * m_horizontalSize;
+    for (int i = 0; i < blockCount; ++i) {
+        inPlaceReplaceBlockWith(m_table + i * 64, swapTable);
+    }
+}
+
+void ComponentTable::inPlaceReplaceBlockWith(float *block, int (*swapTable)[8]) {
     for (int i = 0; i < 8; ++i) {
         for (int j = 0; j < 8; ++j) {
-            uint8_t swapPosition = swapTable[i][j];
-            for (int k = 0; k < m_verticalSize; ++k) {
-                for (int l = 0; l < m_horizontalSize; ++l) {
-                    float value = m_table[i][j][k][l];
-                    m_table[i][j][k][l] = m_table[swapPosition >> 3u][swapPosition & 0x7u][k][l];
-                    m_table[swapPosition >> 3u][swapPosition & 0x7u][k][l] = value;
-                }
-            }
+            float value = block[i * 8 + j];
+            block[i * 8 + j] = block[swapTable[i][j]];
+            block[swapTable[i][j]] = value;
         }
     }
 }
 
 float ComponentTable::convertToCorrectCoefficient(uint16_t rawCoefficient, int length) {
     float result;
+    if (length == 0) {
+        return 0.0f;
+    }
     // like 1's complement, if first bit is 0, then return its negative
     // else return input
     if ((rawCoefficient >> (length - 1)) == 0) {
@@ -598,42 +782,39 @@ float ComponentTable::convertToCorrectCoefficient(uint16_t rawCoefficient, int l
     return result;
 }
 
-float ComponentTable::readDc(std::ifstream &ifs, const HuffmanTable &dcTable, BitStreamBuffer &bsb) {
-    ifs >> bsb;
-    BitStream bs;
-    bs.putWord(bsb, 1);
-    uint8_t output;
-    // Decode n from huffman table
-    // read 1 bit per time until it match corresponding dc huffman table
-    while (!dcTable.getCode(bs.getWord(), bs.getLength(), output)) {
-        if (bs.putWord(bsb, 1)) {
-            ifs >> bsb;
-        }
+uint16_t ComponentTable::readBits(BitReader &reader, int length) {
+    if (length == 0) {
+        return 0;
     }
-    bs.clear();
-    int readLength = output;
-    // read following length of decoded word
-    while ((output = bs.putWord(bsb, output))) {
-        ifs >> bsb;
-    }
-    uint16_t rawCoefficient = bs.getWord();
-    bs.clear();
-    return convertToCorrectCoefficient(rawCoefficient, readLength);
+    return (uint16_t) reader.get(length);
 }
 
-ComponentTable::ACValue ComponentTable::readAc(std::ifstream &ifs, const HuffmanTable &acTable, BitStreamBuffer &bsb) {
-    ifs >> bsb;
-    BitStream bs;
-    bs.putWord(bsb, 1);
-    uint8_t output;
+float ComponentTable::readDc(BitReader &reader, const HuffmanTable &dcTable) {
     // Decode n from huffman table
-    // read 1 bit per time until it match corresponding dc huffman table
-    while (!acTable.getCode(bs.getWord(), bs.getLength(), output)) {
-        if (bs.putWord(bsb, 1)) {
-            ifs >> bsb;
-        }
+    uint8_t output = dcTable.decode(reader);
+    if (output > 16) {
+        // dc difference never has more than 16 bits
+        reader.fail();
+        return 0.0f;
     }
+    // read following length of decoded word
+    return convertToCorrectCoefficient(readBits(reader, output), output);
+}
+
+ComponentTable::ACValue ComponentTable::readAc(BitReader &reader, const HuffmanTable &acTable) {
     ComponentTable::ACValue acValue{};
+    // short codeword and its coefficient bits are decoded by single look up
+    reader.ensure(HuffmanTable::LOOKAHEAD_BITS);
+    const HuffmanTable::ACLookupEntry &entry = acTable.m_acLookup[reader.peek(HuffmanTable::LOOKAHEAD_BITS)];
+    if (entry.length) {
+        reader.skip(entry.length);
+        acValue.state = AC_NORMAL_STATE;
+        acValue.trailingZero = entry.trailingZero;
+        acValue.value = entry.value;
+        return acValue;
+    }
+    // Decode n from huffman table
+    uint8_t output = acTable.decode(reader);
     // if decoded word is 0x00, then it indicated following elements of component table is 0
     if (output == 0x00) {
         acValue.state = AC_ALL_ZERO;
@@ -644,52 +825,39 @@ ComponentTable::ACValue ComponentTable::readAc(std::ifstream &ifs, const Huffman
         // decoded higher 4 bit indicate following n elements of component table is 0, lower 4 bit indicate bit length to read
         acValue.state = AC_NORMAL_STATE;
         acValue.trailingZero = (output >> 4u);
-        output = (output & 0x0Fu);
-        int readLength = output;
-        bs.clear();
+        int readLength = (output & 0x0Fu);
         // read following length of decoded word
-        while ((output = bs.putWord(bsb, output))) {
-            ifs >> bsb;
-        }
-        uint16_t rawCoefficient = bs.getWord();
-        bs.clear();
-        acValue.value = convertToCorrectCoefficient(rawCoefficient, readLength);
+        acValue.value = convertToCorrectCoefficient(readBits(reader, readLength), readLength);
     }
     return acValue;
 }
 
-ComponentTable::~ComponentTable() {
-    for (int i = 0; i < 8; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            for (int k = 0; k < m_verticalSize; ++k) {
-                delete[] m_table[i][j][k];
-            }
-            delete[] m_table[i][j];
-        }
+void MCU::init(const JPEG &jpeg, Arena &arena) {
+    for (int i = 0; i < jpeg.m_sof0.m_componentSize; ++i) {
+        m_component[i] = arena.create<ComponentTable>();
+        // higher 4 bit is this component's horizontal sample factor, lower 4 bit is this component's vertical sample factor
+        int verticalSize = static_cast<int>(jpeg.m_sof0.m_component[i].m_sampleFactor & 0x0fu);
+        int horizontalSize = (jpeg.m_sof0.m_component[i].m_sampleFactor >> 4u);
+        m_component[i]->init(arena, verticalSize, horizontalSize);
     }
 }
 
-void MCU::read(std::ifstream &ifs, const JPEG &jpeg, BitStreamBuffer &bsb) {
+bool MCU::read(BitReader &reader, const JPEG &jpeg, float dcPredictor[4]) {
     for (int i = 0; i < jpeg.m_sof0.m_componentSize; ++i) {
         // higher 4 bit is the dc table use to decode this component's, lower 4 bit is the ac table use to decode this component's
         const HuffmanTable *dc = jpeg.m_dht.m_huffmanTable[JPEG::DC_COMPONENT][jpeg.m_sos.m_component[i].m_dcac >> 4u];
         const HuffmanTable *ac = jpeg.m_dht.m_huffmanTable[JPEG::AC_COMPONENT][jpeg.m_sos.m_component[i].m_dcac &
                                                                                0x0fu];
-        m_component[i] = new ComponentTable[jpeg.m_sof0.m_componentSize];
-        // higher 4 bit is this component's horizontal sample factor, lower 4 bit is this component's vertical sample factor
-        int verticalSize = static_cast<int>(jpeg.m_sof0.m_component[i].m_sampleFactor & 0x0fu);
-        int horizontalSize = (jpeg.m_sof0.m_component[i].m_sampleFactor >> 4u);
-        m_component[i]->init(verticalSize, horizontalSize);
-        if (jpeg.m_mcus.m_lastMcu) {
-            m_component[i]->read(ifs,
-                                 jpeg.m_mcus.m_lastMcu->m_component[i]->m_table[0][0][verticalSize - 1][horizontalSize -
-                                                                                                        1], *dc, *ac,
-                                 bsb);
-
-        } else {
-            m_component[i]->read(ifs, 0, *dc, *ac, bsb);
+        if (!m_component[i]->read(reader, dcPredictor[i], *dc, *ac,
+                                  jpeg.m_naturalOrder ? ComponentTable::NATURAL_ORDER : ComponentTable::ZIGZAG_ORDER,
+                                  jpeg.m_quantization[i])) {
+            return false;
+        }
+        if (jpeg.m_componentTableHook) {
+            jpeg.m_componentTableHook->onComponentTable(jpeg, i, *m_component[i]);
         }
     }
+    return true;
 }
 
 std::ostream &operator<<(std::ostream &os, const MCU &data) {
@@ -701,20 +869,163 @@ std::ostream &operator<<(std::ostream &os, const MCU &data) {
     return os;
 }
 
-void MCUS::read(std::ifstream &ifs, const JPEG &jpeg) {
+void MCUS::init(JPEG &jpeg, int maxRowCount) {
     // Calculate how many mcu in row and column
     m_mcuWidth = (jpeg.m_sof0.m_width - 1) / (8 * jpeg.m_sof0.m_maxHorizontalComponent) + 1;
     m_mcuHeight = (jpeg.m_sof0.m_height - 1) / (8 * jpeg.m_sof0.m_maxVerticalComponent) + 1;
-    m_mcu = new MCU *[m_mcuHeight];
-    BitStreamBuffer bsb;
-    // read each mcu
-    for (int i = 0; i < m_mcuHeight; ++i) {
-        m_mcu[i] = new MCU[m_mcuWidth];
+    m_rowCount = std::min(maxRowCount, m_mcuHeight);
+    m_mcu = jpeg.m_arena.createArray<MCU *>(m_rowCount);
+    for (int i = 0; i < m_rowCount; ++i) {
+        m_mcu[i] = jpeg.m_arena.createArray<MCU>(m_mcuWidth);
         for (int j = 0; j < m_mcuWidth; ++j) {
-            m_mcu[i][j].read(ifs, jpeg, bsb);
-            m_lastMcu = &m_mcu[i][j];
+            m_mcu[i][j].init(jpeg, jpeg.m_arena);
+        }
+    }
+}
+
+void MCUS::read(ByteReader &reader, JPEG &jpeg) {
+    // allocate every mcu before decoding, so that restart intervals can be decoded in parallel without touching arena
+    init(jpeg, (jpeg.m_sof0.m_height - 1) / (8 * jpeg.m_sof0.m_maxVerticalComponent) + 1);
+    // whole remaining data is already in memory, so bit reader read compressed data in place
+    const uint8_t *compressedData = reader.getCurrent();
+    size_t compressedSize = reader.getRemaining();
+
+    // without DRI, whole compressed data is a single restart interval
+    int mcuCount = m_mcuWidth * m_mcuHeight;
+    int restartInterval = jpeg.m_dri.m_restartInterval ? jpeg.m_dri.m_restartInterval : mcuCount;
+    int intervalCount = (mcuCount - 1) / restartInterval + 1;
+    std::vector<size_t> intervalStart, intervalEnd;
+    size_t end = splitRestartInterval(compressedData, compressedSize, intervalStart, intervalEnd);
+    if ((int) intervalStart.size() < intervalCount) {
+        // restart markers are missing
+        reader.fail();
+        return;
+    }
+
+    if (jpeg.m_componentTableHook) {
+        jpeg.m_componentTableHook->onScanStart(jpeg);
+    }
+
+    // decode restart intervals on multiple threads, each thread take next undecoded interval until all are decoded or
+    // one of them is corrupt
+    std::atomic<int> nextInterval(0);
+    std::atomic<bool> failed(false);
+    auto decodeIntervals = [&]() {
+        int interval;
+        while (!failed && (interval = nextInterval++) < intervalCount) {
+            int firstMcu = interval * restartInterval;
+            if (!readInterval(compressedData + intervalStart[interval],
+                              intervalEnd[interval] - intervalStart[interval], jpeg, firstMcu,
+                              std::min(restartInterval, mcuCount - firstMcu))) {
+                failed = true;
+            }
+        }
+    };
+    int threadCount = std::min((int) std::max(std::thread::hardware_concurrency(), 1u), intervalCount);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; ++i) {
+        threads.emplace_back(decodeIntervals);
+    }
+    decodeIntervals();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    if (failed) {
+        reader.fail();
+        return;
+    }
+
+    // move cursor to the marker right after compressed data
+    reader.skip(end);
+}
+
+void MCUS::readRows(ByteReader &reader, JPEG &jpeg) {
+    init(jpeg, ROW_RING_SIZE);
+    const uint8_t *compressedData = reader.getCurrent();
+    size_t compressedSize = reader.getRemaining();
+    int restartInterval = jpeg.m_dri.m_restartInterval;
+
+    if (jpeg.m_componentTableHook) {
+        jpeg.m_componentTableHook->onScanStart(jpeg);
+    }
+
+    // end of each restart interval is only looked for when decoding reach it
+    size_t end = findMarker(compressedData, compressedSize, 0);
+    BitReader bitReader(compressedData, end);
+    float dcPredictor[4] = {};
+    int mcuIndex = 0;
+    for (int i = 0; i < m_mcuHeight; ++i) {
+        MCU *mcuRow = getRow(i);
+        for (int j = 0; j < m_mcuWidth; ++j, ++mcuIndex) {
+            if (restartInterval && mcuIndex && mcuIndex % restartInterval == 0) {
+                if (end + 1 >= compressedSize || compressedData[end + 1] < 0xD0 || compressedData[end + 1] > 0xD7) {
+                    // restart marker is missing
+                    reader.fail();
+                    return;
+                }
+                size_t start = end + 2;
+                end = findMarker(compressedData, compressedSize, start);
+                bitReader = BitReader(compressedData + start, end - start);
+                std::fill(dcPredictor, dcPredictor + 4, 0.0f);
+            }
+            if (!mcuRow[j].read(bitReader, jpeg, dcPredictor)) {
+                reader.fail();
+                return;
+            }
+        }
+        if (jpeg.m_componentTableHook) {
+            jpeg.m_componentTableHook->onMCURow(jpeg, i);
+        }
+    }
+
+    // move cursor to the marker right after compressed data
+    reader.skip(end);
+}
+
+size_t MCUS::findMarker(const uint8_t *data, size_t size, size_t position) {
+    while (position + 1 < size) {
+        const uint8_t *found = static_cast<const uint8_t *>(memchr(data + position, 0xFF, size - position - 1));
+        if (!found) {
+            break;
+        }
+        position = found - data;
+        uint8_t marker = data[position + 1];
+        if (marker == 0x00) {
+            // skip stuffed zero byte
+            position += 2;
+        } else if (marker == 0xFF) {
+            // fill byte before marker
+            position += 1;
+        } else {
+            return position;
+        }
+    }
+    return size;
+}
+
+size_t MCUS::splitRestartInterval(const uint8_t *data, size_t size, std::vector<size_t> &intervalStart,
+                                  std::vector<size_t> &intervalEnd) {
+    intervalStart.push_back(0);
+    size_t position = findMarker(data, size, 0);
+    // RSTn end current interval and start next one, any other marker terminate compressed data
+    while (position < size && data[position + 1] >= 0xD0 && data[position + 1] <= 0xD7) {
+        intervalEnd.push_back(position);
+        intervalStart.push_back(position + 2);
+        position = findMarker(data, size, position + 2);
+    }
+    intervalEnd.push_back(position);
+    return position;
+}
+
+bool MCUS::readInterval(const uint8_t *data, size_t size, const JPEG &jpeg, int firstMcu, int mcuCount) {
+    BitReader reader(data, size);
+    float dcPredictor[4] = {};
+    for (int i = firstMcu; i < firstMcu + mcuCount; ++i) {
+        if (!m_mcu[i / m_mcuWidth][i % m_mcuWidth].read(reader, jpeg, dcPredictor)) {
+            return false;
         }
     }
+    return true;
 }
 
 std::ostream &operator<<(std::ostream &os, const MCUS &data) {
@@ -728,70 +1039,133 @@ std::ostream &operator<<(std::ostream &os, const MCUS &data) {
     return os;
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, JPEG &data) {
+bool JPEG::readHeader(ByteReader &reader) {
+    JPEG &data = *this;
     char header[3] = {};
-    readData(ifs, header, 2);
-    cout << "[INFO] Header " << hexify(header, 2) << "." << endl;
+    readData(reader, header, 2);
     if (!checkData(header, JPEG::MARKER_MAGIC_NUMBER, sizeof(JPEG::MARKER_MAGIC_NUMBER))) {
-        cout << "[ERROR] JPEG marker mismatch." << endl;
-        exit(1);
+        return false;
     }
-    readData(ifs, header, 2);
-    do {
-        cout << "[INFO] Header " << hexify(header, 2) << "." << endl;
+    bool frameFound = false;
+    readData(reader, header, 2);
+    while (!reader.hasFailed()) {
         if (SOS::checkSegment(header)) {
-            ifs >> data.m_sos;
+            reader >> data.m_sos;
 #ifdef DEBUG
             std::cout << data.m_sos;
 #endif
-            break;
+            // compressed data can not be decoded without frame size, sampling and tables
+            return frameFound && !reader.hasFailed() && checkTables();
         } else if (DRI::checkSegment(header)) {
-            ifs >> data.m_dri;
+            reader >> data.m_dri;
 #ifdef DEBUG
             std::cout << data.m_dri;
 #endif
         } else if (DHT::checkSegment(header)) {
-            ifs >> data.m_dht;
+            reader >> data.m_dht;
 #ifdef DEBUG
             std::cout
                     << data.m_dht;
 #endif
         } else if (SOF0::checkSegment(header)) {
-            ifs >> data.m_sof0;
+            reader >> data.m_sof0;
+            frameFound = true;
 #ifdef DEBUG
             std::cout << data.m_sof0;
 #endif
         } else if (DQT::checkSegment(header)) {
-            ifs >> data.m_dqt;
+            reader >> data.m_dqt;
 #ifdef DEBUG
             std::cout << data.m_dqt;
 #endif
         } else if (APP0::checkSegment(header)) {
-            ifs >> data.m_app0;
+            reader >> data.m_app0;
 #ifdef DEBUG
             std::cout << data.m_app0;
 #endif
         } else if (COM::checkSegment(header)) {
-            ifs >> data.m_com;
+            reader >> data.m_com;
 #ifdef DEBUG
             std::cout << data.m_com;
 #endif
         } else {
-            cout << "[ERROR] Unable to recognize header " << hexify(header, 2) << "." << endl;
-            exit(1);
+            return false;
         }
-        readData(ifs, header, 2);
-    } while (true);
+        readData(reader, header, 2);
+    }
+    return false;
+}
 
-    data.m_mcus.read(ifs, data);
-    readData(ifs, header, 2);
-    if (!checkData(header, JPEG::EIO_MARKER_MAGIC_NUMBER, sizeof(JPEG::EIO_MARKER_MAGIC_NUMBER))) {
-        cout << "[ERROR] Unable to recognize header " << hexify(header, 2) << "." << endl;
-        exit(1);
+bool JPEG::readScan(ByteReader &reader) {
+    // memory needed to decode the image is known from now on
+    m_arena.reserve(estimateArenaSize());
+    if (m_streaming) {
+        m_mcus.readRows(reader, *this);
     } else {
-        cout << "[INFO] Successfully parse the file." << endl;
+        m_mcus.read(reader, *this);
+    }
+    char header[3] = {};
+    readData(reader, header, 2);
+    return !reader.hasFailed() &&
+           checkData(header, JPEG::EIO_MARKER_MAGIC_NUMBER, sizeof(JPEG::EIO_MARKER_MAGIC_NUMBER));
+}
+
+ByteReader &operator>>(ByteReader &reader, JPEG &data) {
+    if (!data.readHeader(reader)) {
+        cout << "[ERROR] Invalid or truncated JPEG header." << endl;
+        exit(1);
     }
-    return ifs;
+    if (!data.readScan(reader)) {
+        cout << "[ERROR] Corrupt or truncated compressed data." << endl;
+        exit(1);
+    }
+    return reader;
+}
+
+bool JPEG::checkTables() const {
+    if (m_sos.m_componentSize != m_sof0.m_componentSize) {
+        return false;
+    }
+    for (int i = 0; i < m_sof0.m_componentSize; ++i) {
+        const DHTComponent &component = m_sos.m_component[i];
+        if (component.m_id != i + 1 || !m_dht.m_huffmanTable[DC_COMPONENT][component.m_dcac >> 4u] ||
+            !m_dht.m_huffmanTable[AC_COMPONENT][component.m_dcac & 0x0fu]) {
+            return false;
+        }
+        uint8_t dqtId = m_sof0.m_component[i].m_dqtId;
+        if (dqtId > 3 || !m_dqt.m_qs[dqtId]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void JPEG::printSummary(std::ostream &os) const {
+    os << "Width: " << m_sof0.m_width << std::endl;
+    os << "Height: " << m_sof0.m_height << std::endl;
+    os << "Component Size: " << (int) m_sof0.m_componentSize << std::endl;
+    for (int i = 0; i < m_sof0.m_componentSize; ++i) {
+        const ColorComponent &component = m_sof0.m_component[i];
+        os << "Component " << (int) component.m_id << ": sampling " << (component.m_sampleFactor >> 4u) << "x"
+           << (component.m_sampleFactor & 0x0fu) << ", quantization table " << (int) component.m_dqtId << std::endl;
+    }
+    os << "Quantization Tables:";
+    for (int i = 0; i < 4; ++i) {
+        if (m_dqt.m_qs[i]) {
+            os << " " << i << ((m_dqt.m_PTq[i] & 0xf0u) ? " (16-bit)" : " (8-bit)");
+        }
+    }
+    os << std::endl;
+    os << "Huffman Tables:";
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < 2; ++j) {
+            if (m_dht.m_huffmanTable[i][j]) {
+                os << (i == DC_COMPONENT ? " DC " : " AC ") << j;
+            }
+        }
+    }
+    os << std::endl;
+    os << "Restart Interval: " << m_dri.m_restartInterval << std::endl;
 }
 
 std::ostream &operator<<(std::ostream &os, const JPEG &data) {
@@ -804,6 +1178,46 @@ std::ostream &operator<<(std::ostream &os, const JPEG &data) {
     return os;
 }
 
-JPEG::~JPEG() {
-    delete m_image;
+int JPEG::getOutputWidth() const {
+    // round up, so that partial block at the edge still produce a pixel
+    return (m_sof0.m_width * m_blockSize + 7) / 8;
+}
+
+int JPEG::getOutputHeight() const {
+    return (m_sof0.m_height * m_blockSize + 7) / 8;
+}
+
+size_t JPEG::estimateArenaSize() const {
+    size_t mcuWidth = (m_sof0.m_width - 1) / (8 * m_sof0.m_maxHorizontalComponent) + 1;
+    size_t mcuHeight = (m_sof0.m_height - 1) / (8 * m_sof0.m_maxVerticalComponent) + 1;
+    // only a ring of mcu rows is kept when streaming
+    size_t mcuRowCount = m_streaming ? std::min(mcuHeight, (size_t) MCUS::ROW_RING_SIZE) : mcuHeight;
+    size_t mcuCount = mcuWidth * mcuRowCount;
+    size_t mcuSampleCount = m_blockSize * m_blockSize * m_sof0.m_maxVerticalComponent * m_sof0.m_maxHorizontalComponent;
+    size_t imageHeight = mcuHeight * m_blockSize * m_sof0.m_maxVerticalComponent;
+    // mcus and their component tables
+    size_t size = mcuRowCount * sizeof(MCU *) + mcuCount * sizeof(MCU);
+    for (int i = 0; i < m_sof0.m_componentSize; ++i) {
+        size_t blockCount = (m_sof0.m_component[i].m_sampleFactor >> 4u) * (m_sof0.m_component[i].m_sampleFactor & 0x0fu);
+        size += mcuCount * (sizeof(ComponentTable) + blockCount * 64 * sizeof(float) + ComponentTable::BLOCK_ALIGNMENT +
+                            blockCount + alignof(max_align_t));
+    }
+    size_t imageWidth = mcuWidth * m_blockSize * m_sof0.m_maxHorizontalComponent;
+    size += sizeof(Image);
+    if (m_imageMcu) {
+        // upsampled image mcus
+        size += mcuHeight * sizeof(ImageMCU *) + mcuCount * sizeof(ImageMCU);
+        size += m_sof0.m_componentSize * mcuCount *
+                (m_blockSize * m_sof0.m_maxVerticalComponent * sizeof(float *) + mcuSampleCount * sizeof(float));
+    } else {
+        // single upsampled row and column lookup of each component, and a few rows at component resolution
+        size += m_sof0.m_componentSize * (imageWidth * sizeof(float) + mcuSampleCount * sizeof(int) +
+                                          2 * alignof(max_align_t));
+        size += 3 * ((imageWidth + 2) * sizeof(float) + alignof(max_align_t));
+    }
+    // interleaved pixels, rows are padded to alignment, only pixels of one mcu row are buffered when streaming
+    size_t stride = (imageWidth * 3 + Image::ROW_ALIGNMENT - 1) / Image::ROW_ALIGNMENT * Image::ROW_ALIGNMENT;
+    size_t pixelRowCount = m_streaming ? m_blockSize * m_sof0.m_maxVerticalComponent : imageHeight;
+    size += pixelRowCount * stride + Image::ROW_ALIGNMENT;
+    return size;
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+//
+// Created by Edge on 2020/6/14.
+//
+
+#ifndef JPEG_CODEC_ARENA_H
+#define JPEG_CODEC_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator, memory is handed out from few big chunks and released all at once
+class Arena {
+public:
+    Arena() : m_chunk(nullptr), m_used(0), m_capacity(0) {};
+
+    Arena(const Arena &) = delete;
+
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena();
+
+    // make sure following size bytes of allocation can be served without allocating another chunk
+    void reserve(size_t size);
+
+    void *allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    // destructor of object created by arena is never called, so only trivially destructible type is allowed
+    template<typename T, typename... Args>
+    T *create(Args &&... args) {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena never destroy its object");
+        return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template<typename T>
+    T *createArray(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena never destroy its object");
+        T *result = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; ++i) {
+            new(result + i) T();
+        }
+        return result;
+    }
+
+    // release all chunks, every pointer handed out becomes invalid
+    void release();
+
+    size_t getChunkCount() const;
+
+private:
+    void addChunk(size_t size);
+
+    static constexpr size_t MIN_CHUNK_SIZE = 1u << 20u;
+
+    std::vector<uint8_t *> m_chunks;
+    uint8_t *m_chunk;
+    size_t m_used;
+    size_t m_capacity;
+};
+
+#endif //JPEG_CODEC_ARENA_H
@@ -10,43 +10,136 @@
 class IDequantization {
 public:
     virtual void process(JPEG &jpeg) = 0;
+
+    // dequantize single block, used by fused pipeline
+    virtual void processBlock(float *block, const DQT &dqt, int tableIndex) = 0;
+
+    // called before any block is processed by fused pipeline, so that tables derived from dqt can be built
+    virtual void prepare(const DQT &) {};
+
+    // factor of each natural position that processBlock multiply with, used to dequantize while reading
+    virtual void getTable(const DQT &dqt, int tableIndex, float *table) = 0;
 };
 
 class NaiveDequantization : public IDequantization {
 public:
     void process(JPEG &jpeg) override;
+
+    void processBlock(float *block, const DQT &dqt, int tableIndex) override;
+
+    void getTable(const DQT &dqt, int tableIndex, float *table) override;
+};
+
+// Dequantization for AANIDCT, quantization tables are pre-multiplied by AAN scale factors, so that dequantization also
+// scales coefficients as AANIDCT requires
+class AANDequantization : public IDequantization {
+public:
+    AANDequantization() : m_scaledTable{} {};
+
+    void process(JPEG &jpeg) override;
+
+    void processBlock(float *block, const DQT &dqt, int tableIndex) override;
+
+    void prepare(const DQT &dqt) override;
+
+    void getTable(const DQT &dqt, int tableIndex, float *table) override;
+
+private:
+    // scaled quantization tables in natural order
+    float m_scaledTable[4][64];
 };
 
 class IDezigzag {
 public:
     virtual void process(JPEG &jpeg) = 0;
+
+    // dezigzag single block, used by fused pipeline
+    virtual void processBlock(float *block) = 0;
+
+    // if true, entropy decoder place coefficients in natural order directly, and nothing is left to do for strategy
+    virtual bool isDoneWhileReading() const {
+        return false;
+    }
 };
 
 class NaiveDezigzag : public IDezigzag {
 public:
     void process(JPEG &jpeg) override;
+
+    void processBlock(float *block) override;
+
+private:
+    static int ZIGZAG_TABLE[8][8];
 };
 
 class EnhancedDezigzag : public IDezigzag {
 public:
     void process(JPEG &jpeg) override;
+
+    void processBlock(float *block) override;
+
+private:
+    static int SWAP_TABLE[8][8];
+};
+
+// coefficients are written to natural position during entropy decode, so both process and processBlock do nothing
+class NaturalOrderDezigzag : public IDezigzag {
+public:
+    void process(JPEG &) override {};
+
+    void processBlock(float *) override {};
+
+    bool isDoneWhileReading() const override {
+        return true;
+    }
 };
 
 class IIDCT {
 public:
     virtual void process(JPEG &jpeg) = 0;
+
+    // inverse DCT single block in place, used by fused pipeline
+    virtual void processBlock(float *block) = 0;
+
+    // same as processBlock, but lastNonzero (zigzag index of last nonzero coefficient) let strategy skip work on
+    // sparse block
+    virtual void processSparseBlock(float *block, int /*lastNonzero*/) {
+        processBlock(block);
+    }
+
+    // side length of output block, it is smaller than 8 if strategy also downscale, and output is stored at top-left of
+    // block
+    virtual int getBlockSize() const {
+        return 8;
+    }
+
 protected:
+    // zigzag index 0 ~ 2 fall in top-left 2x2 of block, 0 ~ 9 fall in top-left 4x4
+    static constexpr int SPARSE_2X2_LAST_NONZERO = 2;
+    static constexpr int SPARSE_4X4_LAST_NONZERO = 9;
+
     float coefficientPrecompute(int x, int y);
+
+    // cosine term of IDCT, m_value[i][x] = cos((2i + 1) * x * pi / 16), computed once when program starts
+    struct CosineTable {
+        CosineTable();
+
+        double m_value[8][8];
+    };
+
+    static const CosineTable COSINE_TABLE;
 };
 
 class NaiveIDCT : public IIDCT {
 public:
     void process(JPEG &jpeg) override;
 
+    void processBlock(float *block) override;
+
 private:
-    void performIdctOnComponentTable(ComponentTable &table, ComponentTable &result);
+    void performIdctOnComponentTable(ComponentTable &table);
 
-    float computeCoefficientAtIndex(ComponentTable &table, int verticalComponent, int horizonComponent, int i, int j);
+    float computeCoefficientAtIndex(const float *block, int i, int j);
 
 };
 
@@ -54,22 +147,172 @@ class DimensionReductionIDCT : public IIDCT {
 public:
     void process(JPEG &jpeg) override;
 
+    void processBlock(float *block) override;
+
+private:
+    static void performIdctOnComponentTable(ComponentTable &table);
+
+    static void performIdctOnBlock(float *block);
+
+};
+
+// Arai-Agui-Nakajima fast IDCT, only 5 multiplication per 1-D 8-point IDCT
+// input coefficients should be dequantized by AANDequantization, which scale them by AAN scale factor
+class AANIDCT : public IIDCT {
+public:
+    void process(JPEG &jpeg) override;
+
+    void processBlock(float *block) override;
+
+    // AAN_SCALE_FACTOR[k] = cos(k * pi / 16) * sqrt(2) for k > 0, 1 for k = 0
+    static const float AAN_SCALE_FACTOR[8];
+
+    void processSparseBlock(float *block, int lastNonzero) override;
+
+private:
+    static void performIdctOnComponentTable(ComponentTable &table);
+
+    static void performIdctOnBlock(float *block);
+
+    static void performSparseIdctOnBlock(float *block, int lastNonzero);
+
+    // only top-left size x size (size <= 4) coefficients are nonzero
+    static void performReducedIdctOnBlock(float *block, int size);
+
+    friend class SIMDIDCT;
+};
+
+// same AAN IDCT as AANIDCT, but vectorized over whole block with transposes in registers
+// AVX2 kernel is selected at runtime if cpu support it, otherwise SSE2 kernel is used
+// input coefficients should be dequantized by AANDequantization
+class SIMDIDCT : public IIDCT {
+public:
+    SIMDIDCT();
+
+    void process(JPEG &jpeg) override;
+
+    void processBlock(float *block) override;
+
+    void processSparseBlock(float *block, int lastNonzero) override;
+
+private:
+    void performIdctOnComponentTable(ComponentTable &table);
+
+    static void performIdctOnBlockSse2(float *block);
+
+    static void performIdctOnBlockAvx2(float *block);
+
+    // only top-left 4x4 coefficients are nonzero
+    static void performReducedIdctOnBlockSse2(float *block);
+
+    static void performReducedIdctOnBlockAvx2(float *block);
+
+    void (*m_kernel)(float *block);
+    void (*m_reducedKernel)(float *block);
+};
+
+// Loeffler-Ligtenberg-Moschytz IDCT in fixed point, computed in the same way as libjpeg's jidctint, so that result is
+// deterministic regardless of floating point behavior
+// input coefficients should be dequantized by NaiveDequantization
+class IntegerIDCT : public IIDCT {
+public:
+    void process(JPEG &jpeg) override;
+
+    void processBlock(float *block) override;
+
+    void processSparseBlock(float *block, int lastNonzero) override;
+
+private:
+    void performIdctOnComponentTable(ComponentTable &table);
+
+    static void performIdctOnBlock(float *block);
+
+    static constexpr int CONST_BITS = 13;
+    static constexpr int PASS1_BITS = 2;
+};
+
+// IDCT which only reconstruct (8 / scaleDenominator) x (8 / scaleDenominator) samples from coefficients of the same size,
+// used to decode at 1/2, 1/4 or 1/8 scale, 1/8 scale only use dc
+// input coefficients should be dequantized by NaiveDequantization
+class ScaledIDCT : public IIDCT {
+public:
+    // scaleDenominator should be 1, 2, 4 or 8
+    explicit ScaledIDCT(int scaleDenominator);
+
+    void process(JPEG &jpeg) override;
+
+    void processBlock(float *block) override;
+
+    void processSparseBlock(float *block, int lastNonzero) override;
+
+    int getBlockSize() const override;
+
 private:
-    static void performIdctOnComponentTable(ComponentTable &table, ComponentTable &result);
+    void performIdctOnComponentTable(ComponentTable &table);
 
+    int m_blockSize;
+    // m_cosine[x][u] = C(u) / 2 * cos((2x + 1) * u * pi / (2 * m_blockSize)), C(0) = 1 / sqrt(2), C(u) = 1 otherwise
+    float m_cosine[8][8];
+};
+
+// convert level shifted YCbCr samples into interleaved 8-bit RGB or BGR pixels in fixed point, SSE2 kernel convert 8
+// pixels and AVX2 kernel convert 16 pixels at once with saturating packs, kernel is selected at runtime, and remaining
+// pixels use scalar kernel with the same arithmetic
+class ColorConverter {
+public:
+    static constexpr int RGB_ORDER = 0;
+    static constexpr int BGR_ORDER = 1;
+
+    ColorConverter();
+
+    // write count pixels of 3 bytes each to output, channels in pixelOrder
+    void convert(const float *y, const float *cb, const float *cr, uint8_t *output, int count, int pixelOrder) const;
+
+private:
+    // return number of pixels converted, which is a multiple of its batch size
+    static int convertSse2(const float *y, const float *cb, const float *cr, uint8_t *output, int count,
+                           int pixelOrder);
+
+    static int convertAvx2(const float *y, const float *cb, const float *cr, uint8_t *output, int count,
+                           int pixelOrder);
+
+    static void convertScalar(const float *y, const float *cb, const float *cr, uint8_t *output, int count,
+                              int pixelOrder);
+
+    int (*m_kernel)(const float *y, const float *cb, const float *cr, uint8_t *output, int count, int pixelOrder);
+
+    // byte shuffle masks which interleave 16 pixels of 3 channels into 3 vectors, m_value[i][c] pick bytes of i-th
+    // output vector from c-th channel and zero the others, computed once when program starts
+    struct InterleaveMask {
+        InterleaveMask();
+
+        uint8_t m_value[3][3][16];
+    };
+
+    static const InterleaveMask INTERLEAVE_MASK;
+
+    // factors are scaled by 2^SCALE_BITS
+    static constexpr int SCALE_BITS = 14;
+    static constexpr int CR_TO_R = 22970;   // 1.402
+    static constexpr int CB_TO_G = -5638;   // -0.34414
+    static constexpr int CR_TO_G = -11700;  // -0.71414
+    static constexpr int CB_TO_B = 29032;   // 1.772
+
+    friend class MergedUpsampling;
 };
 
 class ImageBlock {
 public:
     ImageBlock(): m_table(nullptr) {};
-    void FromComponentTable(const ComponentTable &table, int maxVerticalComponent, int maxHorizontalComponent);
+    void FromComponentTable(Arena &arena, const ComponentTable &table, int blockSize, int maxVerticalComponent,
+                            int maxHorizontalComponent);
 
     float **m_table;
 };
 
 class ImageMCU {
 public:
-    void fromMCU(const JPEG &jpeg, const MCU &mcu);
+    void fromMCU(Arena &arena, const JPEG &jpeg, const MCU &mcu);
 
     ImageBlock m_block[4];
 
@@ -77,41 +320,185 @@ public:
 
 class Image {
 public:
-    Image() : m_imcu(nullptr), m_imageBuffer{}, m_storedInBuffer(false) {};
-    ~Image();
+    static constexpr int ROW_ALIGNMENT = 64;
+
+    explicit Image(Arena &arena) : m_arena(arena), m_imcu(nullptr), m_pixels(nullptr), m_stride(0),
+                                   m_pixelOrder(ColorConverter::RGB_ORDER), m_storedInBuffer(false) {};
+    // take image size, sampling and pixel order from jpeg
+    void setup(const JPEG &jpeg, const MCUS &mcus);
+
     void fromMCUS(const JPEG &jpeg, const MCUS &mcus);
 
+    // build image mcus of a single mcu row, m_imcu must hold m_mcuHeight rows
+    void fromMCURow(const JPEG &jpeg, const MCUS &mcus, int row);
+
+    // allocate pixel buffer covering whole mcus
+    void allocatePixels();
+
+    // color convert image rows [firstRow, firstRow + rowCount) of image mcus into output with rows stride bytes apart,
+    // only pixels within image are written
+    void convertPixels(int firstRow, int rowCount, uint8_t *output, size_t stride) const;
+
     void handleImageBuffer(const JPEG &jpeg);
     void toPpm(std::ofstream &ofs, const JPEG &jpeg);
     void saveToBmp(const std::string &filename, const JPEG &jpeg);
-    static float yCbCrConverter(int component, float y, float cb, float cr);
-    static uint8_t clamp(float value);
 
+    // image mcus and image buffer are allocated from arena of the JPEG they come from
+    Arena &m_arena;
     int m_mcuWidth, m_mcuHeight;
+    // size of output image and side length of each block, which are smaller than jpeg's when decoding at reduced scale
+    int m_width, m_height;
+    int m_blockSize;
     int m_componentSize;
     int m_maxVerticalComponent, m_maxHorizontalComponent;
     ImageMCU **m_imcu;
-    float **m_imageBuffer[3];
+    // interleaved 8-bit pixels in one allocation, rows are m_stride bytes apart and start at multiple of ROW_ALIGNMENT
+    uint8_t *m_pixels;
+    size_t m_stride;
+    // ColorConverter::RGB_ORDER or ColorConverter::BGR_ORDER
+    int m_pixelOrder;
+    ColorConverter m_colorConverter;
     bool m_storedInBuffer;
-
-    static constexpr int R_COMPONENT = 0;
-    static constexpr int G_COMPONENT = 1;
-    static constexpr int B_COMPONENT = 2;
 };
 
 class Upsampling {
 public:
-    virtual void process(JPEG &jpeg) = 0;
+    // build image of jpeg, by default its pixels are converted at once with prepare() and processRows()
+    virtual void process(JPEG &jpeg);
+
+    // whether full resolution copy of every component is built in image mcus before color conversion
+    virtual bool isUsingImageMCU() const { return true; }
+
+    // allocate row buffers of the image from its arena, called once before processRows()
+    virtual void prepare(JPEG &jpeg);
+
+    // convert image rows [firstRow, firstRow + rowCount), which cover whole mcu rows, into output with rows stride
+    // bytes apart, mcu rows above and below them must still be kept by mcus
+    // only pixels within output width and height are written, so output may be exactly as large as the image
+    virtual void processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride);
+
+protected:
+    ColorConverter m_colorConverter;
 };
 
 class NaiveUpsampling : public Upsampling {
 public:
+    NaiveUpsampling() : m_image(nullptr) {};
+
     void process(JPEG &jpeg) override;
+
+    void prepare(JPEG &jpeg) override;
+
+    // image mcus of each mcu row are built when the row is converted
+    void processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) override;
+
+private:
+    // image mcus built by processRows()
+    Image *m_image;
+};
+
+// upsample one image row of each component straight from IDCT output blocks, and color convert it into image buffer,
+// so that no full resolution copy of components is made
+// nearest neighbour, component at full or half horizontal resolution is copied or duplicated with SIMD
+class DirectUpsampling : public Upsampling {
+public:
+    DirectUpsampling() : m_row(), m_componentRow(nullptr), m_columnOffset() {};
+
+    bool isUsingImageMCU() const override { return false; }
+
+    void prepare(JPEG &jpeg) override;
+
+    void processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) override;
+
+private:
+    // row of each component at full resolution, and at its own resolution before duplication
+    float *m_row[3];
+    float *m_componentRow;
+    // other sampling ratio use column offset within block row, which is the same for every mcu
+    int *m_columnOffset[3];
 };
 
-class Decoder {
+// merged upsampling and color conversion for 2x2 luma and 1x1 chroma sampling, like libjpeg's jdmerge, which produce
+// two output rows from two luma rows and one chroma row, chroma terms of color conversion are computed once and
+// shared by 2x2 pixels, chroma is replicated as nearest neighbour so output is the same as DirectUpsampling
+// SSE2 kernel convert 4 and AVX2 kernel convert 8 chroma samples at once, kernel is selected at runtime
+class MergedUpsampling : public Upsampling {
 public:
-    Decoder() : m_dequantization(nullptr), m_dezigzag(nullptr) {};
+    MergedUpsampling();
+
+    bool isUsingImageMCU() const override { return false; }
+
+    void prepare(JPEG &jpeg) override;
+
+    void processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) override;
+
+    // whether sampling of jpeg is 2x2/1x1/1x1
+    static bool isSupported(const JPEG &jpeg);
+
+private:
+    // convert count chroma samples and 2 * count luma samples of each row into two rows of pixels
+    void convertRowPair(const float *y0, const float *y1, const float *cb, const float *cr, uint8_t *output0,
+                        uint8_t *output1, int count, int pixelOrder) const;
+
+    // return number of chroma samples converted, which is a multiple of its batch size
+    static int convertRowPairSse2(const float *y0, const float *y1, const float *cb, const float *cr,
+                                  uint8_t *output0, uint8_t *output1, int count, int pixelOrder);
+
+    static int convertRowPairAvx2(const float *y0, const float *y1, const float *cb, const float *cr,
+                                  uint8_t *output0, uint8_t *output1, int count, int pixelOrder);
+
+    static void convertRowPairScalar(const float *y0, const float *y1, const float *cb, const float *cr,
+                                     uint8_t *output0, uint8_t *output1, int count, int pixelOrder);
+
+    int (*m_kernel)(const float *y0, const float *y1, const float *cb, const float *cr, uint8_t *output0,
+                    uint8_t *output1, int count, int pixelOrder);
+
+    float *m_luma[2];
+    float *m_cb;
+    float *m_cr;
+    // second row of a pair which is below image
+    uint8_t *m_scratch;
+};
+
+// libjpeg style triangle filter for component at half horizontal and/or vertical resolution, e.g. 4:2:2 and 4:2:0,
+// each output sample is 3/4 of nearest input sample and 1/4 of next nearest one in each direction, edges are
+// replicated, other sampling ratio fall back to nearest neighbour
+class FancyUpsampling : public Upsampling {
+public:
+    FancyUpsampling() : m_row(), m_nearRow(nullptr), m_farRow(nullptr), m_blendedRow(nullptr) {};
+
+    bool isUsingImageMCU() const override { return false; }
+
+    void prepare(JPEG &jpeg) override;
+
+    void processRows(const JPEG &jpeg, int firstRow, int rowCount, uint8_t *output, size_t stride) override;
+
+private:
+    float *m_row[3];
+    // rows at component's own resolution, with one sample of padding on each side for triangle filter
+    float *m_nearRow;
+    float *m_farRow;
+    float *m_blendedRow;
+};
+
+// receive pixels of 3 bytes each in decoder's pixel order, mcu row by mcu row from Decoder::process() or
+// Decoder::decodeRows()
+class IRowSink {
+public:
+    // called once before any row, with size of decoded image
+    virtual void onStart(int, int) {}
+
+    // rows [firstRow, firstRow + rowCount) come in top-down order, row i start at pixels + (i - firstRow) * stride,
+    // pixels are only valid during the call
+    virtual void onRows(int firstRow, int rowCount, const uint8_t *pixels, size_t stride) = 0;
+};
+
+class Decoder : public IComponentTableHook {
+public:
+    Decoder() : m_dequantization(nullptr), m_dezigzag(nullptr), m_idct(nullptr), m_upsampling(nullptr),
+                m_fusedPipeline(false), m_dequantizeWhileReading(false), m_pixelOrder(ColorConverter::RGB_ORDER),
+                m_mergedUpsampling(false), m_rowSink(nullptr), m_rowUpsampling(nullptr), m_rowPixels(nullptr),
+                m_rowStride(0) {};
 
     Decoder &setDequantization(IDequantization *dequantizationStrategy);
 
@@ -121,13 +508,94 @@ public:
 
     Decoder &setUpsampling(Upsampling *upsamplingStrategy);
 
+    // dezigzag, dequantize and IDCT each block right after it is decoded, instead of running them as full image passes
+    Decoder &setFusedPipeline(bool fusedPipeline);
+
+    // multiply each coefficient with its quantization factor as soon as it is decoded, so that zero coefficients cost
+    // nothing
+    Decoder &setDequantizeWhileReading(bool dequantizeWhileReading);
+
+    // channel order of output pixels, ColorConverter::RGB_ORDER or ColorConverter::BGR_ORDER
+    Decoder &setPixelOrder(int pixelOrder);
+
+    // use MergedUpsampling instead of upsampling strategy when image is 2x2/1x1/1x1 sampled
+    Decoder &setMergedUpsampling(bool mergedUpsampling);
+
+    // hand rows of pixels to sink as process() convert each mcu row into image buffer, so that downstream work can
+    // start before whole image is converted, nullptr to stop
+    Decoder &setRowSink(IRowSink *sink);
+
+    // read jpeg from memory, data is no longer needed once read() return
+    // with fused pipeline each block is also dezigzagged, dequantized and IDCTed while reading
+    void read(const uint8_t *data, size_t size, JPEG &jpeg);
+
+    // read jpeg file, which is memory mapped if possible
+    void read(const std::string &filename, JPEG &jpeg);
+
+    // only read header of jpeg, so that size and sampling are known without decoding
+    // return false without printing if file can't be opened or header is malformed or truncated
+    static bool probe(const uint8_t *data, size_t size, JPEG &jpeg);
+
+    static bool probe(const std::string &filename, JPEG &jpeg);
+
     void process(JPEG &jpeg);
 
+    // decode jpeg in memory, which is parsed in place, and write its pixels of 3 bytes each in pixel order straight to
+    // output, row i start at output + i * outputStride (0 for tightly packed rows), width and height are returned if
+    // not null, bytes between rows are left untouched
+    // return false before writing output if header or compressed data is malformed or truncated, or right after reading
+    // header if output is smaller than outputStride * (height - 1) + width * 3 bytes, bad input never print or exit
+    // a decoder decode one image at a time, as strategies keep tables of the image being decoded
+    bool decode(const uint8_t *data, size_t size, uint8_t *output, size_t outputSize, size_t outputStride = 0,
+                int *width = nullptr, int *height = nullptr);
+
+    // decode jpeg one mcu row at a time, and hand rows of pixels to sink as soon as they are converted, only a few mcu
+    // rows and one mcu row of pixels are kept, so memory used doesn't grow with image height
+    // fused pipeline and an upsampling strategy which doesn't use image mcus are needed
+    void decodeRows(const uint8_t *data, size_t size, IRowSink &sink);
+
+    void decodeRows(const std::string &filename, IRowSink &sink);
+
+    void onScanStart(JPEG &jpeg) override;
+
+    void onComponentTable(const JPEG &jpeg, int componentIndex, ComponentTable &table) override;
+
+    void onMCURow(JPEG &jpeg, int row) override;
+
 private:
+    // merged upsampling if it is enabled and support sampling of jpeg, otherwise upsampling strategy
+    Upsampling *selectUpsampling(const JPEG &jpeg);
+
+    // convert mcu row into row buffer, and hand its rows within image to row sink
+    void outputMCURow(const JPEG &jpeg, int row);
+
+    // hand rows starting at firstRow to row sink, without padding rows below image
+    void outputRows(const JPEG &jpeg, int firstRow, int rowCount, const uint8_t *pixels, size_t stride);
+
+    // run dezigzag, dequantization and IDCT passes which are not fused into reading
+    void processCoefficients(JPEG &jpeg);
+
+    // convert image into output mcu row by mcu row with rows stride bytes apart, each mcu row is handed to row sink if
+    // there is one, output only need to hold pixels within image
+    void convertRows(JPEG &jpeg, Upsampling &upsampling, uint8_t *output, size_t stride);
+
+    // set up jpeg and component table hook for reading with strategies of decoder
+    void prepareRead(JPEG &jpeg);
+
     IDequantization *m_dequantization;
     IDezigzag *m_dezigzag;
     IIDCT *m_idct;
     Upsampling *m_upsampling;
+    bool m_fusedPipeline;
+    bool m_dequantizeWhileReading;
+    int m_pixelOrder;
+    bool m_mergedUpsampling;
+    MergedUpsampling m_merged;
+    IRowSink *m_rowSink;
+    // state of decodeRows()
+    Upsampling *m_rowUpsampling;
+    uint8_t *m_rowPixels;
+    size_t m_rowStride;
 };
 
 
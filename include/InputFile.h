@@ -0,0 +1,96 @@
+//
+// Created by Edge on 2020/6/20.
+//
+
+#ifndef JPEG_CODEC_INPUTFILE_H
+#define JPEG_CODEC_INPUTFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Whole content of input file in memory, regular file is memory mapped, and anything which can't be mapped (e.g.
+// pipe) is read into buffer instead
+class InputFile {
+public:
+    InputFile() : m_mapped(nullptr), m_data(nullptr), m_size(0) {};
+
+    InputFile(const InputFile &) = delete;
+
+    InputFile &operator=(const InputFile &) = delete;
+
+    ~InputFile();
+
+    // return false if file can't be opened or read
+    bool open(const std::string &filename);
+
+    void close();
+
+    const uint8_t *getData() const;
+
+    size_t getSize() const;
+
+private:
+#if defined(__unix__) || defined(__APPLE__)
+    // read from descriptor which can't be mapped, e.g. pipe
+    bool readAll(int fd);
+#endif
+
+    void *m_mapped;
+    std::vector<uint8_t> m_buffer;
+    const uint8_t *m_data;
+    size_t m_size;
+};
+
+// Cursor over bytes in memory, segments are parsed from it, multi-byte values are big-endian
+class ByteReader {
+public:
+    ByteReader(const uint8_t *data, size_t size) : m_data(data), m_size(size), m_position(0), m_failed(false) {};
+
+    uint8_t readByte() {
+        if (!require(1)) {
+            return 0;
+        }
+        return m_data[m_position++];
+    }
+
+    uint16_t readWord() {
+        if (!require(2)) {
+            return 0;
+        }
+        uint16_t value = (uint16_t) ((m_data[m_position] << 8u) | m_data[m_position + 1]);
+        m_position += 2;
+        return value;
+    }
+
+    void read(void *output, size_t size);
+
+    void skip(size_t size);
+
+    const uint8_t *getCurrent() const { return m_data + m_position; }
+
+    size_t getRemaining() const { return m_size - m_position; }
+
+    // mark data as malformed, reads after a failure return zeros
+    void fail() { m_failed = true; }
+
+    bool hasFailed() const { return m_failed; }
+
+private:
+    // fail if fewer than size bytes remain, truncated data is never read past its end
+    bool require(size_t size) {
+        if (m_failed || m_size - m_position < size) {
+            m_failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_position;
+    bool m_failed;
+};
+
+#endif //JPEG_CODEC_INPUTFILE_H
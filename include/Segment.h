@@ -8,11 +8,14 @@
 #include <fstream>
 #include <vector>
 #include <cstdint>
+#include <algorithm>
+#include "Arena.h"
+#include "InputFile.h"
 
 typedef struct ColorType {
     uint8_t r, g, b;
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, ColorType &data);
+    friend ByteReader &operator>>(ByteReader &reader, ColorType &data);
 } Color;
 
 class APP0 {
@@ -26,7 +29,7 @@ public:
 
     ~APP0();
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, APP0 &data);
+    friend ByteReader &operator>>(ByteReader &reader, APP0 &data);
 
     friend std::ostream &operator<<(std::ostream &os, const APP0 &data);
 
@@ -46,7 +49,7 @@ public:
 
     static bool checkSegment(const char header[]);
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, COM &data);
+    friend ByteReader &operator>>(ByteReader &reader, COM &data);
 
     friend std::ostream &operator<<(std::ostream &os, const COM &data);
 
@@ -63,17 +66,18 @@ public:
 
     ~DQT();
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, DQT &data);
+    friend ByteReader &operator>>(ByteReader &reader, DQT &data);
 
     friend std::ostream &operator<<(std::ostream &os, const DQT &data);
 
     uint8_t m_PTq[4];
+    // quantization tables are stored in natural order
     void *m_qs[4];
 };
 
 class ColorComponent {
 public:
-    friend std::ifstream &operator>>(std::ifstream &ifs, ColorComponent &data);
+    friend ByteReader &operator>>(ByteReader &reader, ColorComponent &data);
 
     friend std::ostream &operator<<(std::ostream &os, const ColorComponent &data);
 
@@ -86,9 +90,12 @@ class SOF0 {
 public:
     constexpr static char MARKER_MAGIC_NUMBER[] = "\xFF\xC0";
 
+    SOF0() : m_precision(0), m_height(0), m_width(0), m_componentSize(0), m_component{}, m_maxHorizontalComponent(0),
+             m_maxVerticalComponent(0) {};
+
     static bool checkSegment(const char header[]);
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, SOF0 &data);
+    friend ByteReader &operator>>(ByteReader &reader, SOF0 &data);
 
     friend std::ostream &operator<<(std::ostream &os, const SOF0 &data);
 
@@ -102,38 +109,58 @@ public:
     uint8_t m_maxVerticalComponent;
 };
 
-struct BitStreamBuffer {
-    int m_readLength = 8;
-    uint8_t m_buffer = 0;
+class BitReader {
+public:
+    BitReader(const uint8_t *data, size_t size) : m_data(data), m_size(size), m_position(0), m_buffer(0), m_length(0),
+                                                  m_markerReached(false), m_failed(false) {};
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, BitStreamBuffer &data);
-};
+    // make sure there are at least length bits in buffer (length <= 57)
+    void ensure(int length);
 
-class BitStream {
-public:
-    BitStream() : m_length(0), m_buffer(0) {};
+    // peek next length bits (length <= 32), ensure() should be called before
+    uint32_t peek(int length) const;
+
+    void skip(int length);
 
-    // Output if input is not enough to output length
-    // If it's not enough, output remain length
-    int putWord(BitStreamBuffer &input, int length);
+    uint32_t get(int length);
 
-    void clear();
+    // mark compressed data as corrupt, decoding stop at end of current block
+    void fail() { m_failed = true; }
 
-    int getLength() const;
+    bool hasFailed() const { return m_failed; }
 
-    uint16_t getWord() const;
+private:
+    void refill();
 
-    uint16_t m_buffer;
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_position;
+    // buffered bits are left-aligned, only higher m_length bits are valid and the others are zero
+    uint64_t m_buffer;
     int m_length;
+    // once a marker is met, no more byte is pulled and zero bits are fed instead
+    bool m_markerReached;
+    bool m_failed;
 };
 
 class HuffmanTable {
 public:
-    HuffmanTable() : m_length(0), m_codeword{}, m_table{}, m_codeAmountOfBit{} {};
+    // codeword not longer than LOOKAHEAD_BITS can be decoded by single look up
+    static constexpr int LOOKAHEAD_BITS = 9;
+
+    // short ac codeword together with its following coefficient bits, decoded in advance
+    struct ACLookupEntry {
+        int16_t value;
+        uint8_t trailingZero;
+        // total length of codeword and coefficient bits, 0 if they are longer than LOOKAHEAD_BITS
+        uint8_t length;
+    };
+
+    HuffmanTable() : m_length(0), m_codeword{}, m_table{}, m_codeAmountOfBit{}, m_lookup{}, m_acLookup{} {};
 
     ~HuffmanTable();
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, HuffmanTable &data);
+    friend ByteReader &operator>>(ByteReader &reader, HuffmanTable &data);
 
     friend std::ostream &operator<<(std::ostream &os, const HuffmanTable &data);
 
@@ -145,11 +172,21 @@ public:
 
     bool getCode(uint16_t codeword, int length, uint8_t &output) const;
 
+    // fail reader and return 0 if no codeword match
+    uint8_t decode(BitReader &reader) const;
+
     uint8_t m_typeAndId;
     uint8_t m_codeAmountOfBit[16 + 1];
     uint8_t *m_codeword[16 + 1];
     uint32_t m_table[16 + 1];
+    // indexed by next LOOKAHEAD_BITS bits, higher 8 bit is codeword length (0 if longer than LOOKAHEAD_BITS), lower 8 bit
+    // is decoded word
+    uint16_t m_lookup[1u << LOOKAHEAD_BITS];
+    // indexed by next LOOKAHEAD_BITS bits, only built for ac table
+    ACLookupEntry m_acLookup[1u << LOOKAHEAD_BITS];
 private:
+    void buildLookup();
+
     int m_length;
 };
 
@@ -163,7 +200,7 @@ public:
 
     static bool checkSegment(const char header[]);
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, DHT &data);
+    friend ByteReader &operator>>(ByteReader &reader, DHT &data);
 
     friend std::ostream &operator<<(std::ostream &os, const DHT &data);
 
@@ -174,9 +211,11 @@ class DRI {
 public:
     constexpr static char MARKER_MAGIC_NUMBER[] = "\xFF\xDD";
 
+    DRI() : m_restartInterval(0) {};
+
     static bool checkSegment(const char header[]);
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, DRI &data);
+    friend ByteReader &operator>>(ByteReader &reader, DRI &data);
 
     friend std::ostream &operator<<(std::ostream &os, const DRI &data);
 
@@ -186,7 +225,7 @@ public:
 
 class DHTComponent {
 public:
-    friend std::ifstream &operator>>(std::ifstream &ifs, DHTComponent &data);
+    friend ByteReader &operator>>(ByteReader &reader, DHTComponent &data);
 
     friend std::ostream &operator<<(std::ostream &os, const DHTComponent &data);
 
@@ -198,9 +237,12 @@ class SOS {
 public:
     constexpr static char MARKER_MAGIC_NUMBER[] = "\xFF\xDA";
 
+    SOS() : m_componentSize(0), m_component{}, m_spectrumSelectionStart(0), m_spectrumSelectionEnd(0),
+            m_spectrumSelection(0) {};
+
     static bool checkSegment(const char header[]);
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, SOS &data);
+    friend ByteReader &operator>>(ByteReader &reader, SOS &data);
 
     friend std::ostream &operator<<(std::ostream &os, const SOS &data);
 
@@ -215,29 +257,56 @@ class JPEG;
 
 class ComponentTable {
 public:
-    void init(uint8_t verticalSize, uint8_t horizontalSize);
+    static constexpr int BLOCK_ALIGNMENT = 64;
+    // NATURAL_ORDER[i] is natural (row-major) position of i-th coefficient in zigzag order, ZIGZAG_ORDER[i] is just i
+    static const uint8_t NATURAL_ORDER[64];
+    static const uint8_t ZIGZAG_ORDER[64];
+
+    ComponentTable() : m_verticalSize(0), m_horizontalSize(0), m_table(nullptr), m_lastNonzero(nullptr) {};
+
+    void init(Arena &arena, uint8_t verticalSize, uint8_t horizontalSize);
+
+    // 64 consecutive values of block at (verticalComponent, horizonComponent), stored in row-major order
+    float *getBlock(int verticalComponent, int horizonComponent);
+
+    const float *getBlock(int verticalComponent, int horizonComponent) const;
+
+    // zigzag index of last nonzero coefficient of block, 0 if block only has dc
+    int getLastNonzero(int verticalComponent, int horizonComponent) const;
 
-    void read(std::ifstream &ifs, float lastComponentDcValue, const HuffmanTable &dcTable, const HuffmanTable &acTable,
-              BitStreamBuffer &bsb);
+    // dc value is predicted from last component's dc value, dcPredictor is updated after reading
+    // i-th decoded coefficient of block is multiplied by quantization[i] and placed at coefficientOrder[i]
+    // return false if compressed data is corrupt
+    bool read(BitReader &reader, float &dcPredictor, const HuffmanTable &dcTable, const HuffmanTable &acTable,
+              const uint8_t *coefficientOrder, const float *quantization);
 
     friend std::ostream &operator<<(std::ostream &os, const ComponentTable &data);
 
     void multiplyWith(const DQT &dqt, int tableIndex);
 
-    void replaceWith(const ComponentTable &table, int (*replaceTable)[8]);
+    static void multiplyBlockWith(float *block, const DQT &dqt, int tableIndex);
+
+    void replaceWith(int (*replaceTable)[8]);
+
+    static void replaceBlockWith(float *block, int (*replaceTable)[8]);
 
     void inPlaceReplaceWith(int (*swapTable)[8]);
 
-    ~ComponentTable();
+    static void inPlaceReplaceBlockWith(float *block, int (*swapTable)[8]);
 
     uint8_t m_verticalSize;
     uint8_t m_horizontalSize;
-    float **m_table[8][8];
+    // blocks are stored one after another in row-major order, aligned to BLOCK_ALIGNMENT
+    float *m_table;
+    // last nonzero coefficient index of each block, recorded when reading
+    uint8_t *m_lastNonzero;
 
 private:
     static float convertToCorrectCoefficient(uint16_t rawCoefficient, int length);
 
-    float readDc(std::ifstream &ifs, const HuffmanTable &dcTable, BitStreamBuffer &bsb);
+    static uint16_t readBits(BitReader &reader, int length);
+
+    float readDc(BitReader &reader, const HuffmanTable &dcTable);
 
     struct ACValue {
         int state;
@@ -245,7 +314,7 @@ private:
         float value;
     };
 
-    ACValue readAc(std::ifstream &ifs, const HuffmanTable &acTable, BitStreamBuffer &bsb);
+    ACValue readAc(BitReader &reader, const HuffmanTable &acTable);
 
     static constexpr int AC_ALL_ZERO = 0;
     static constexpr int AC_FOLLOWING_SIXTEEN_ZERO = 1;
@@ -255,7 +324,10 @@ private:
 
 class MCU {
 public:
-    void read(std::ifstream &ifs, const JPEG &jpeg, BitStreamBuffer &bsb);
+    void init(const JPEG &jpeg, Arena &arena);
+
+    // return false if compressed data is corrupt
+    bool read(BitReader &reader, const JPEG &jpeg, float dcPredictor[4]);
 
     friend std::ostream &operator<<(std::ostream &os, const MCU &data);
 
@@ -265,30 +337,67 @@ public:
 
 class MCUS {
 public:
-    MCUS() : m_lastMcu(nullptr) {};
+    // reader is failed if compressed data is corrupt
+    void read(ByteReader &reader, JPEG &jpeg);
+
+    // decode mcu rows one after another into a ring of ROW_RING_SIZE rows, component table hook is told of each
+    // finished row, so memory used doesn't grow with image height, reader is failed if compressed data is corrupt
+    void readRows(ByteReader &reader, JPEG &jpeg);
 
-    void read(std::ifstream &ifs, const JPEG &jpeg);
+    // mcu row by its index in image, only the last ROW_RING_SIZE decoded rows are kept when reading rows
+    MCU *getRow(int row) const { return m_mcu[row % m_rowCount]; }
 
     friend std::ostream &operator<<(std::ostream &os, const MCUS &data);
 
+    // decoded rows kept when reading rows, enough for a filter which look at the mcu row above and below
+    static constexpr int ROW_RING_SIZE = 3;
+
     int m_mcuWidth, m_mcuHeight;
+    // number of mcu rows in m_mcu, which is m_mcuHeight unless reading rows
+    int m_rowCount;
     MCU **m_mcu;
-    MCU *m_lastMcu;
+
+private:
+    // compute number of mcus of image, and allocate up to maxRowCount rows of them
+    void init(JPEG &jpeg, int maxRowCount);
+
+    // offset of first marker at or after position, skipping stuffed zero and fill bytes, size if there is none
+    static size_t findMarker(const uint8_t *data, size_t size, size_t position);
+
+    // split compressed data at RSTn markers, return offset of the marker which terminate compressed data
+    static size_t splitRestartInterval(const uint8_t *data, size_t size, std::vector<size_t> &intervalStart,
+                                       std::vector<size_t> &intervalEnd);
+
+    // each restart interval start with reset dc predictor and byte aligned data, so it can be decoded independently
+    bool readInterval(const uint8_t *data, size_t size, const JPEG &jpeg, int firstMcu, int mcuCount);
 
 };
 
 class Image;
 
+class IComponentTableHook {
+public:
+    // called once all tables are read, right before compressed data is decoded
+    virtual void onScanStart(JPEG &jpeg) = 0;
+
+    // called as soon as component table of a mcu is decoded, may be called from multiple threads at the same time
+    virtual void onComponentTable(const JPEG &jpeg, int componentIndex, ComponentTable &table) = 0;
+
+    // called once every component table of a mcu row is decoded, only when mcu rows are read one after another
+    virtual void onMCURow(JPEG &, int) {}
+};
+
 class JPEG {
 public:
     constexpr static char MARKER_MAGIC_NUMBER[] = "\xFF\xD8";
     constexpr static char EIO_MARKER_MAGIC_NUMBER[] = "\xFF\xD9";
 
-    JPEG() : m_rstN(0), m_image(nullptr) {};
-
-    ~JPEG();
+    JPEG() : m_image(nullptr), m_componentTableHook(nullptr), m_blockSize(8), m_naturalOrder(false), m_pixelOrder(0),
+             m_imageMcu(true), m_streaming(false) {
+        std::fill(&m_quantization[0][0], &m_quantization[0][0] + 4 * 64, 1.0f);
+    };
 
-    friend std::ifstream &operator>>(std::ifstream &ifs, JPEG &data);
+    friend ByteReader &operator>>(ByteReader &reader, JPEG &data);
 
     friend std::ostream &operator<<(std::ostream &os, const JPEG &data);
 
@@ -299,13 +408,52 @@ public:
     DHT m_dht;
     DRI m_dri;
     SOS m_sos;
-    uint8_t m_rstN;
     MCUS m_mcus;
 
     Image *m_image;
+    IComponentTableHook *m_componentTableHook;
+    // side length of each block after IDCT, smaller than 8 when decoding at reduced scale
+    int m_blockSize;
+    // entropy decoder place coefficients in natural order instead of zigzag order, so that no dezigzag is needed
+    bool m_naturalOrder;
+    // channel order of output pixels, ColorConverter::RGB_ORDER or ColorConverter::BGR_ORDER
+    int m_pixelOrder;
+    // upsampling build full resolution image mcus, which take most memory of arena
+    bool m_imageMcu;
+    // mcu rows are decoded one after another into a ring of rows, and handed to component table hook as they finish,
+    // instead of decoding whole image before processing it
+    bool m_streaming;
+    // factor of each component's coefficients by zigzag index, applied by entropy decoder, all 1 unless coefficients
+    // are dequantized while reading
+    float m_quantization[4][64];
+    // every memory needed to decode the image is served from arena, and released at once with JPEG
+    Arena m_arena;
 
     static constexpr int DC_COMPONENT = 0;
     static constexpr int AC_COMPONENT = 1;
+
+    // size of decoded image, which is smaller than SOF0's when decoding at reduced scale
+    int getOutputWidth() const;
+
+    int getOutputHeight() const;
+
+    // parse segments up to and including SOS, compressed data is neither decoded nor given memory, return false if
+    // segments are malformed, truncated, or SOS comes without SOF0 or refer to undefined tables
+    bool readHeader(ByteReader &reader);
+
+    // decode compressed data following readHeader(), up to and including EOI, return false if it is corrupt, truncated
+    // or not followed by EOI
+    bool readScan(ByteReader &reader);
+
+    // size, sampling, tables and restart interval read by readHeader(), one field per line
+    void printSummary(std::ostream &os) const;
+
+private:
+    // estimated arena size needed to decode the image, according to SOF0
+    size_t estimateArenaSize() const;
+
+    // every component of SOF0 is in SOS, and huffman and quantization tables they use are defined
+    bool checkTables() const;
 };
 
 #endif //JPEG_CODEC_SEGMENT_H
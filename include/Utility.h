@@ -7,22 +7,17 @@
 
 #include <cstdint>
 #include <cstddef>
-#include <fstream>
+#include <string>
+#include "InputFile.h"
 
-std::ifstream &operator>>(std::ifstream &ifs, uint8_t &a) {
-    ifs.read(reinterpret_cast<char *>(&a), sizeof(uint8_t));
-    return ifs;
+ByteReader &operator>>(ByteReader &reader, uint8_t &a) {
+    a = reader.readByte();
+    return reader;
 }
 
-std::ifstream &operator>>(std::ifstream &ifs, uint16_t &a) {
-    uint8_t buffer;
-    a = 0;
-    for(int i = 0;i < sizeof(uint16_t);++i) {
-        ifs.read(reinterpret_cast<char *>(&buffer), 1);
-        a <<= 8;
-        a |= buffer;
-    }
-    return ifs;
+ByteReader &operator>>(ByteReader &reader, uint16_t &a) {
+    a = reader.readWord();
+    return reader;
 }
 
 static char hexTable[17] = "0123456789ABCDEF";
@@ -60,10 +55,8 @@ std::string hexify(const char a[], int size) {
     return hex;
 }
 
-void readData(std::ifstream &ifs, char buffer[], int size) {
-    for (int i = 0; i < size; ++i) {
-        ifs >> buffer[i];
-    }
+void readData(ByteReader &reader, char buffer[], int size) {
+    reader.read(buffer, size);
 }
 
 bool checkData(const char buffer[], const char target[], int size) {
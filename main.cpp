@@ -8,18 +8,59 @@
 #include <iostream>
 #include <Decoder.h>
 #include <string>
+#include <fstream>
 
 using namespace std;
 
+// write rows to binary ppm as soon as they are decoded, which store rows top-down in RGB order
+class PpmRowWriter : public IRowSink {
+public:
+    explicit PpmRowWriter(const string &filename) : m_ofs(filename, ios::binary), m_width(0) {};
+
+    void onStart(int width, int height) override {
+        m_width = width;
+        m_ofs << "P6\n" << width << " " << height << "\n" << 255 << "\n";
+    }
+
+    void onRows(int, int rowCount, const uint8_t *pixels, size_t stride) override {
+        for (int i = 0; i < rowCount; ++i) {
+            m_ofs.write(reinterpret_cast<const char *>(pixels + i * stride), (streamsize) m_width * 3);
+        }
+    }
+
+private:
+    ofstream m_ofs;
+    int m_width;
+};
+
 int main(int argc, char **argv) {
     string inputFile;
     string outputFile;
+    // decode at 1 / scaleDenominator of original size
+    int scaleDenominator = 1;
+    // triangle filter for subsampled chroma unless nearest neighbour is asked for
+    bool fancyUpsampling = true;
+    // only print header summary
+    bool probe = false;
+    // decode one mcu row at a time into ppm, so that memory doesn't grow with image height
+    bool streaming = false;
     for (int i = 1; i < argc; ++i) {
         string cmd(argv[i++]);
         if (cmd == "-i") {
             inputFile = argv[i];
         } else if (cmd == "-o") {
             outputFile = argv[i];
+        } else if (cmd == "-s") {
+            scaleDenominator = atoi(argv[i]);
+        } else if (cmd == "-u") {
+            fancyUpsampling = string(argv[i]) != "nearest";
+        } else if (cmd == "-p") {
+            // flag without value
+            probe = true;
+            --i;
+        } else if (cmd == "-r") {
+            streaming = true;
+            --i;
         }
     }
     if (inputFile.empty()) {
@@ -31,20 +72,42 @@ int main(int argc, char **argv) {
         }
     }
     JPEG data;
-    // Setup decode strategy
-    Decoder decoder = Decoder().setDequantization(new NaiveDequantization()).setDezigzag(
-                    new EnhancedDezigzag()).setIDCT(new DimensionReductionIDCT()).setUpsampling(new NaiveUpsampling());
-
-    ifstream ifs(inputFile, std::ios::binary);
-    if (ifs.is_open()) {
-        ifs >> data;
-        ifs.close();
-        decoder.process(data);
-        if (!outputFile.empty()) {
-            data.m_image->saveToBmp(outputFile, data);
-        } else {
-            data.m_image->saveToBmp(inputFile.substr(0, inputFile.find(".")) + ".bmp", data);
+    if (probe) {
+        if (!Decoder::probe(inputFile, data)) {
+            cout << "[ERROR] Unable to read header of " << inputFile << "." << endl;
+            return 1;
         }
+        data.printSummary(cout);
+        return 0;
+    }
+    // Setup decode strategy
+    Decoder decoder = Decoder().setDequantization(new AANDequantization()).setDezigzag(
+                    new NaturalOrderDezigzag()).setIDCT(new SIMDIDCT()).setFusedPipeline(
+                    true).setDequantizeWhileReading(true).setPixelOrder(ColorConverter::BGR_ORDER);
+    if (fancyUpsampling) {
+        decoder.setUpsampling(new FancyUpsampling());
+    } else {
+        // merged upsampling replicate chroma too, and is faster for 4:2:0 image
+        decoder.setUpsampling(new DirectUpsampling()).setMergedUpsampling(true);
+    }
+    if (scaleDenominator != 1) {
+        // reduced IDCT work on plain dequantized coefficients
+        decoder.setDequantization(new NaiveDequantization()).setIDCT(new ScaledIDCT(scaleDenominator));
+    }
+
+    if (streaming) {
+        PpmRowWriter writer(!outputFile.empty() ? outputFile : inputFile.substr(0, inputFile.find(".")) + ".ppm");
+        decoder.setPixelOrder(ColorConverter::RGB_ORDER).decodeRows(inputFile, writer);
+        cout << "[INFO] Successfully parse the file." << endl;
+        return 0;
+    }
+    decoder.read(inputFile, data);
+    cout << "[INFO] Successfully parse the file." << endl;
+    decoder.process(data);
+    if (!outputFile.empty()) {
+        data.m_image->saveToBmp(outputFile, data);
+    } else {
+        data.m_image->saveToBmp(inputFile.substr(0, inputFile.find(".")) + ".bmp", data);
     }
 
 }
\ No newline at end of file